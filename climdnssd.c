@@ -12,12 +12,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #include <iphlpapi.h>
 #pragma comment(lib, "IPHLPAPI.lib")
 typedef uint32_t in_addr_t;
+#define sleep(s) Sleep((s) * 1000)
 #elif defined (__linux__) || defined (__FreeBSD__) || defined(sun)
 #include <unistd.h>
 #include <sys/socket.h>
@@ -43,21 +45,59 @@ typedef uint32_t in_addr_t;
 #include <ifaddrs.h>
 #endif
 
+#if !defined(_WIN32)
+#include <pthread.h>
+#define closesocket close
+#endif
+
 #include "mdnssd.h"
 
 static int debug_mode;
 static bool verbose;
+static int resolving;
+
+#define MAX_TYPES	16
+
+// scaling harness: services announced by the in-process responder, and how much
+// cpu per datagram a handle may use with N handles compared to a single one
+#define BENCH_TYPE		"_mdnssd-bench._tcp.local"
+#define BENCH_SERVICES	16
+#define BENCH_SLOWDOWN	2.0
+
+typedef struct {
+	struct in_addr host;
+	int timeout, id, found;
+	double cpu;
+} worker_t;
+
+typedef struct {
+	struct in_addr host;
+	volatile bool running;
+	volatile uint32_t sent;
+} responder_t;
 
 /*---------------------------------------------------------------------------*/
 bool print_services(mdnssd_service_t *slist, void *cookie, bool *stop) {
 	mdnssd_service_t *s;
 
 	for (s = slist; s; s = s->next) {
-		char *host = strdup(inet_ntoa(s->host));
+		char host[INET6_ADDRSTRLEN];
+		// source is IPv6 when its IPv4 address is any
+		if (s->host.s_addr != INADDR_ANY) inet_ntop(AF_INET, &s->host, host, sizeof(host));
+		else inet_ntop(AF_INET6, &s->host6, host, sizeof(host));
 		printf("[%s] %s\t%05hu\t%s %us %s\n", host, inet_ntoa(s->addr), s->port,
-			   s->name, s->since, s->expired ? "EXPIRED" : "ACTIVE");
-		free(host);
+			   s->name, s->since, s->expired ? (s->evicted ? "EVICTED" : "EXPIRED") : "ACTIVE");
 		if (verbose) {
+			printf(" priority %hu weight %hu\n", s->priority, s->weight);
+			for (int i = 1; i < s->addr_count; i++) {
+			  printf(" also at %s\n", inet_ntoa(s->addrs[i]));
+			}
+			for (int i = 0; i < s->addr6_count; i++) {
+			  char buf[INET6_ADDRSTRLEN];
+			  inet_ntop(AF_INET6, s->addrs6 + i, buf, sizeof(buf));
+			  if (IN6_IS_ADDR_LINKLOCAL(s->addrs6 + i)) printf(" also at %s%%%u\n", buf, s->scope6);
+			  else printf(" also at %s\n", buf);
+			}
 			for (int i = 0; i < s->attr_count; i++) {
 			  printf(" %s =  %s\n", s->attr[i].name, s->attr[i].value);
 			}
@@ -74,6 +114,233 @@ bool print_services(mdnssd_service_t *slist, void *cookie, bool *stop) {
 	return false;
 }
 
+/*---------------------------------------------------------------------------*/
+bool print_resolved(const char *name, mdnssd_service_t *service, void *cookie) {
+	if (service) print_services(service, cookie, NULL);
+	else printf("%s not found\n", name);
+
+	// nothing else to wait for
+	if (!--resolving) mdnssd_control((struct mdnssd_handle_s*) cookie, MDNS_SUSPEND);
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+bool count_services(mdnssd_service_t *slist, void *cookie, bool *stop) {
+	worker_t *worker = (worker_t*) cookie;
+
+	for (mdnssd_service_t *s = slist; s; s = s->next) {
+		if (s->expired) worker->found--;
+		else worker->found++;
+	}
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static double thread_cpu(void) {
+#ifdef _WIN32
+	FILETIME create, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user);
+	return ((((uint64_t) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+			(((uint64_t) user.dwHighDateTime << 32) | user.dwLowDateTime)) / 1e7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static int put_name(uint8_t *p, const char *name) {
+	uint8_t *start = p;
+
+	while (*name) {
+		const char *dot = strchr(name, '.');
+		int len = dot ? dot - name : (int) strlen(name);
+		*p++ = len;
+		memcpy(p, name, len);
+		p += len;
+		name += dot ? len + 1 : len;
+	}
+	*p++ = 0;
+
+	return p - start;
+}
+
+/*---------------------------------------------------------------------------*/
+static int put_rr(uint8_t *p, const char *name, uint16_t type, uint16_t class, uint32_t ttl, const void *data, int len) {
+	int n = put_name(p, name);
+
+	p[n++] = type >> 8; p[n++] = type;
+	p[n++] = class >> 8; p[n++] = class;
+	p[n++] = ttl >> 24; p[n++] = ttl >> 16; p[n++] = ttl >> 8; p[n++] = ttl;
+	p[n++] = len >> 8; p[n++] = len;
+	memcpy(p + n, data, len);
+
+	return n + len;
+}
+
+/*---------------------------------------------------------------------------*/
+// announces BENCH_SERVICES instances (one per datagram) every 5ms, multicast
+// is looped back to local sockets and never leaves the host (ttl 0)
+#ifdef _WIN32
+DWORD WINAPI run_responder(void *arg) {
+	DWORD ttl = 0, loop = 1;
+#else
+void *run_responder(void *arg) {
+	unsigned char ttl = 0, loop = 1;
+#endif
+	responder_t *responder = (responder_t*) arg;
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in group = { 0 };
+	uint8_t packets[BENCH_SERVICES][512];
+	int sizes[BENCH_SERVICES];
+
+	group.sin_family = AF_INET;
+	group.sin_port = htons(5353);
+	group.sin_addr.s_addr = inet_addr("224.0.0.251");
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (void*) &responder->host, sizeof(responder->host));
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void*) &ttl, sizeof(ttl));
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (void*) &loop, sizeof(loop));
+
+	for (int i = 0; i < BENCH_SERVICES; i++) {
+		char instance[128], target[64], txt[16];
+		uint8_t *p = packets[i], rdata[128];
+		uint16_t port = 1000 + i;
+		int n;
+
+		sprintf(instance, "bench-%02d.%s", i, BENCH_TYPE);
+		sprintf(target, "bench-%02d.local", i);
+		// response with 4 answers
+		memcpy(p, "\x00\x00\x84\x00\x00\x00\x00\x04\x00\x00\x00\x00", 12);
+		p += 12;
+		n = put_name(rdata, instance);
+		p += put_rr(p, BENCH_TYPE, 12, 1, 4500, rdata, n);
+		memset(rdata, 0, 4);
+		rdata[4] = port >> 8; rdata[5] = port;
+		n = put_name(rdata + 6, target) + 6;
+		p += put_rr(p, instance, 33, 0x8001, 120, rdata, n);
+		n = sprintf(txt + 1, "id=%d", i);
+		txt[0] = n;
+		p += put_rr(p, instance, 16, 0x8001, 4500, txt, n + 1);
+		p += put_rr(p, target, 1, 0x8001, 120, &responder->host, 4);
+		sizes[i] = p - packets[i];
+	}
+
+	while (responder->running) {
+		for (int i = 0; i < BENCH_SERVICES; i++) {
+			sendto(sock, (void*) packets[i], sizes[i], 0, (struct sockaddr*) &group, sizeof(group));
+			responder->sent++;
+		}
+#ifdef _WIN32
+		Sleep(5);
+#else
+		usleep(5000);
+#endif
+	}
+
+	closesocket(sock);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+#ifdef _WIN32
+DWORD WINAPI run_worker(void *arg) {
+#else
+void *run_worker(void *arg) {
+#endif
+	worker_t *worker = (worker_t*) arg;
+	struct mdnssd_handle_s *handle = mdnssd_init(debug_mode, worker->host, true);
+	double start;
+
+	if (!handle) {
+		printf("[%d] cannot open socket\n", worker->id);
+		return 0;
+	}
+
+	// each handle is fully independent, there is nothing shared
+	start = thread_cpu();
+	mdnssd_query(handle, BENCH_TYPE, false, worker->timeout, &count_services, worker);
+	worker->cpu = thread_cpu() - start;
+	mdnssd_close(handle);
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// runs 1 to count handles on as many threads against the local responder, every
+// handle must see all services and the cpu each one spends per datagram must stay
+// flat (it would grow with shared contention), returns false otherwise
+bool run_parallel(int count, struct in_addr host, int timeout) {
+	worker_t *workers = calloc(count, sizeof(worker_t));
+	responder_t responder = { host, true, 0 };
+	double base = 0;
+	bool rc = true;
+#ifdef _WIN32
+	HANDLE *threads = calloc(count, sizeof(HANDLE));
+	HANDLE announcer = CreateThread(NULL, 0, &run_responder, &responder, 0, NULL);
+#else
+	pthread_t *threads = calloc(count, sizeof(pthread_t)), announcer;
+	pthread_create(&announcer, NULL, &run_responder, &responder);
+#endif
+
+	for (int n = 1; n <= count; n++) {
+		uint32_t sent = responder.sent;
+		uint64_t datagrams;
+		int complete = 0;
+		double cpu = 0, per;
+
+		for (int i = 0; i < n; i++) {
+			workers[i] = (worker_t) { host, timeout, i, 0, 0 };
+#ifdef _WIN32
+			threads[i] = CreateThread(NULL, 0, &run_worker, workers + i, 0, NULL);
+#else
+			pthread_create(threads + i, NULL, &run_worker, workers + i);
+#endif
+		}
+
+		for (int i = 0; i < n; i++) {
+#ifdef _WIN32
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+#else
+			pthread_join(threads[i], NULL);
+#endif
+			if (workers[i].found == BENCH_SERVICES) complete++;
+			else printf("[%d] %d of %d services\n", i, workers[i].found, BENCH_SERVICES);
+			cpu += workers[i].cpu;
+		}
+
+		// every handle receives all that the responder has sent meanwhile
+		datagrams = (uint64_t) (responder.sent - sent) * n;
+
+		per = datagrams ? cpu * 1e6 / datagrams : 0;
+		if (n == 1) base = per;
+		printf("%2d handles: %d complete, %.0f datagrams/s, %.2fus cpu per datagram (x%.2f)\n",
+			   n, complete, datagrams / (double) timeout, per, base ? per / base : 0);
+
+		if (complete != n || !datagrams) rc = false;
+		if (base && per > base * BENCH_SLOWDOWN) {
+			printf("cpu per datagram grows with %d handles, scaling is not linear\n", n);
+			rc = false;
+		}
+	}
+
+	responder.running = false;
+#ifdef _WIN32
+	WaitForSingleObject(announcer, INFINITE);
+	CloseHandle(announcer);
+#else
+	pthread_join(announcer, NULL);
+#endif
+
+	printf("%s\n", rc ? "scaling OK" : "scaling FAILED");
+	free(threads);
+	free(workers);
+	return rc;
+}
+
 /*---------------------------------------------------------------------------*/
 // search argv for either stand-along
 // arguments like -d or arguments with a value
@@ -177,10 +444,12 @@ struct in_addr get_interface(char* iface) {
 int main(int argc, char* argv[]) {
   char* query_arg;
   struct mdnssd_handle_s *handle;
-  char *arg_val, *addr = NULL;
-  int timeout = 0, count = 1;
-  bool unicast = false, compliant = true;
-  struct in_addr host = { INADDR_ANY };
+  char *arg_val, *addr = NULL, *instance = NULL, *hostname = NULL, *types = NULL, *filters = NULL, *persist = NULL;
+  char *publish = NULL, *shared_name = NULL;
+  int timeout = 0, count = 1, parallel = 0;
+  bool unicast = false, compliant = true, ipv6 = false, order = false;
+  struct in_addr host = { INADDR_ANY }, hosts[MDNS_MAX_IFACES];
+  int host_count = 0;
 
   // get debug argument
   debug_mode = get_arg(argc, argv, "-d", NULL);
@@ -191,6 +460,12 @@ int main(int argc, char* argv[]) {
   // get unicast argument
   unicast = get_arg(argc, argv, "-u", NULL);
 
+  // get selection order argument
+  order = get_arg(argc, argv, "-o", NULL);
+
+  // get IPv6 argument
+  ipv6 = get_arg(argc, argv, "-6", NULL);
+
   // get RFC6862 compliant argument
   compliant = !get_arg(argc, argv, "-r", NULL);
 
@@ -203,40 +478,183 @@ int main(int argc, char* argv[]) {
   // get count argument
   if (get_arg(argc, argv, "-c", &arg_val)) count = atoi(arg_val);
 
-  // last argument should be query
+  // get parallel handles argument
+  if (get_arg(argc, argv, "-p", &arg_val)) parallel = atoi(arg_val);
+
+  // get direct resolution arguments
+  if (get_arg(argc, argv, "-i", &arg_val)) instance = arg_val;
+  if (get_arg(argc, argv, "-a", &arg_val)) hostname = arg_val;
+
+  // get other types to browse argument
+  if (get_arg(argc, argv, "-s", &arg_val)) types = arg_val;
+
+  // get warm-start cache file argument
+  if (get_arg(argc, argv, "-w", &arg_val)) persist = arg_val;
+
+  // get filters argument
+  if (get_arg(argc, argv, "-f", &arg_val)) filters = arg_val;
+
+  // get shared table arguments (publisher or reader)
+  if (get_arg(argc, argv, "-e", &arg_val)) publish = arg_val;
+  if (get_arg(argc, argv, "-m", &arg_val)) shared_name = arg_val;
+
+  // last argument should be query (unless resolving)
   query_arg = argv[argc-1];
 
-  if (query_arg[0] != '_') {
-	  printf("usage: mdnssd [-h <ip | iface>] [-t <duration>] [-c <count>] [-v] [-u] [-r] [-d] <query>\n"
-		     "\t-h <ip|iface> : ip address or intefrace name\n"
+  if (query_arg[0] != '_' && !instance && !hostname && !shared_name && parallel <= 0) {
+	  printf("usage: mdnssd [-h <ip | iface>[,...] | all] [-t <duration>] [-c <count>] [-p <handles>] [-s <type>[,...]] [-f <filter>[,...]] [-o] [-w <file>] [-e <name>] [-v] [-u] [-6] [-r] [-d] <query> | -i <instance> | -a <hostname> | -m <name>\n"
+		     "\t-h <ip|iface> : ip address or intefrace name, comma-separated list or 'all'\n"
 			 "\t-t <duration> : duration of each query (default = infinite)\n"
 		     "\t-c <count> : do <count> queries and exit (default = 1)\n"
+		     "\t-p <handles> : scaling test, 1 to <handles> handles on as many threads against a local\n"
+		     "\t               responder, each step lasts <duration> (default 2s), no query needed\n"
+		     "\t-s <type>[,...] : also browse these types (when found if query is " MDNS_META_QUERY ")\n"
+		     "\t-f <filter>[,...] : only report services passing all of txt:<key>[=<value>], port:<min>[-<max>], subnet:<ip>/<bits>\n"
+		     "\t-o : display instances in the order they should be tried (RFC2782)\n"
+		     "\t-w <file> : load cache from <file> at start and save it every minute and at exit\n"
+		     "\t-e <name> : publish services in shared memory <name> for other processes\n"
 		     "\t-v : display TXT records\n"
-		     "\t-u : ask for unicast replies\n"
+		     "\t-6 : also use IPv6 (ff02::fb)\n"
+		     "\t-u : always ask for unicast replies (default is first query only)\n"
 		     "\t-r : don't comply to RFC6762 (use random port instead of 5353 to issue queries)\n"
 		     "\t-d : debug (very verbose)\n"
-		     "\t<query> : query to be perfomed, e.g. _raop._tcp.local\n");
+		     "\t<query> : query to be perfomed, e.g. _raop._tcp.local or _printer._sub._http._tcp.local\n"
+		     "\t          (" MDNS_META_QUERY " lists types)\n"
+		     "\t-i <instance> : resolve an instance, e.g. kitchen._raop._tcp.local\n"
+		     "\t-a <hostname> : resolve a host, e.g. kitchen.local\n"
+		     "\t-m <name> : read services published in shared memory <name> (no socket), every second\n"
+		     "\t            for <duration> (default = once)\n");
 	  return 1;
   }
 
+  // reader only maps what a publisher writes, no handle is needed
+  if (shared_name) {
+	mdnssd_shared_t *shared = mdnssd_shared_open(shared_name);
+	uint32_t version = 0;
+	bool first = true;
+
+	if (!shared) {
+		printf("cannot open shared table %s\n", shared_name);
+		return 1;
+	}
+	for (time_t end = time(NULL) + timeout; ; sleep(1)) {
+		if (first || mdnssd_shared_version(shared) != version) {
+			first = false;
+			mdnssd_service_t *list = mdnssd_shared_get(shared, &version);
+			print_services(list, NULL, NULL);
+			mdnssd_free_list(list);
+			printf("=========================== version %u ============================\n", version);
+		}
+		if (time(NULL) >= end) break;
+	}
+	mdnssd_shared_close(shared);
+	return 0;
+  }
+
 #ifdef _WIN32
    winsock_init();
 #endif
 
-  host = get_interface(addr);
-  handle = mdnssd_init(debug_mode, host, compliant);
+  // several interfaces share one handle, 'all' lets the library find them
+  if (addr && !strcmp(addr, "all")) host_count = -1;
+  else if (addr && strchr(addr, ',')) {
+	char *list = strdup(addr), *p = list;
+	while (p && host_count < MDNS_MAX_IFACES) {
+		char *next = strchr(p, ',');
+		if (next) *next++ = '\0';
+		hosts[host_count++] = get_interface(p);
+		p = next;
+	}
+	free(list);
+  }
+
+  host = host_count > 0 ? hosts[0] : get_interface(host_count < 0 ? NULL : addr);
+
+  if (parallel > 0) {
+	bool rc;
+	printf("using interface %s with up to %d handles\n", inet_ntoa(host), parallel);
+	rc = run_parallel(parallel, host, timeout ? timeout : 2);
+#ifdef _WIN32
+	winsock_close();
+#endif
+	return rc ? 0 : 1;
+  }
+
+  if (host_count) handle = mdnssd_init_ifaces(debug_mode, host_count > 0 ? hosts : NULL, host_count, compliant);
+  else handle = mdnssd_init(debug_mode, host, compliant);
 
   if (!handle) {
 	printf("cannot open socket\n");
 	exit(1);
   }
 
-  printf("using interface %s\n", inet_ntoa(host));
+  if (ipv6 && !mdnssd_set_ipv6(handle, true)) printf("cannot use IPv6\n");
+
+  if (host_count < 0) printf("using all interfaces\n");
+  else if (host_count) {
+	printf("using interfaces");
+	for (int i = 0; i < host_count; i++) printf(" %s", inet_ntoa(hosts[i]));
+	printf("\n");
+  } else printf("using interface %s\n", inet_ntoa(host));
+
+  // direct resolutions don't browse, only wait for answers
+  if (instance || hostname) {
+	// answers from cache are given right away
+	if (instance && (++resolving, !mdnssd_resolve_instance(handle, instance, (timeout ? timeout : 5) * 1000, &print_resolved, handle))) resolving--;
+	if (hostname && (++resolving, !mdnssd_resolve_host(handle, hostname, (timeout ? timeout : 5) * 1000, &print_resolved, handle))) resolving--;
+	if (resolving) mdnssd_query(handle, NULL, unicast, timeout ? timeout : 5, NULL, NULL);
+	count = 0;
+  }
+
+  if (persist) mdnssd_set_persist(handle, persist, 60);
+
+  if (publish && !mdnssd_set_publish(handle, publish, 0)) printf("cannot publish to %s\n", publish);
+
+  if (filters) {
+	char *list = strdup(filters), *p = list;
+	while (p) {
+		char *next = strchr(p, ',');
+		if (next) *next++ = '\0';
+		if (!mdnssd_add_filter(handle, p)) printf("invalid filter %s\n", p);
+		p = next;
+	}
+	free(list);
+  }
+
+  // other types are either browsed along with query or once enumeration finds them
+  if (types) {
+	char *list = strdup(types), *p = list;
+	const char *wanted[MAX_TYPES + 1] = { NULL };
+	int n = 0;
+	while (p && n < MAX_TYPES) {
+		char *next = strchr(p, ',');
+		if (next) *next++ = '\0';
+		wanted[n++] = p;
+		if (strcmp(query_arg, MDNS_META_QUERY)) mdnssd_subscribe(handle, p);
+		p = next;
+	}
+	if (!strcmp(query_arg, MDNS_META_QUERY)) mdnssd_set_enumeration(handle, true, wanted);
+	free(list);
+  } else if (!strcmp(query_arg, MDNS_META_QUERY)) {
+	mdnssd_set_enumeration(handle, true, NULL);
+  }
 
   while (count--) {
 	mdnssd_query(handle, query_arg, unicast, timeout, &print_services, (void*) handle);
+	if (!strcmp(query_arg, MDNS_META_QUERY)) {
+		mdnssd_type_t *list = mdnssd_get_types(handle);
+		for (mdnssd_type_t *t = list; t; t = t->next) printf("%s\t%d instances %us\n", t->name, t->instances, t->since);
+		mdnssd_free_types(list);
+	}
+	if (order) {
+		mdnssd_service_t *list = mdnssd_select(handle, query_arg, true);
+		printf("selection order:\n");
+		for (mdnssd_service_t *s = list; s; s = s->next) printf(" %s\t%hu/%hu\n", s->name, s->priority, s->weight);
+		mdnssd_free_list(list);
+	}
 	printf("===============================================================\n");
-	mdnssd_control(handle, MDNS_RESET);
+	// last one is kept so that it can be saved
+	if (count) mdnssd_control(handle, MDNS_RESET);
   }
 
   mdnssd_close(handle);
@@ -2,32 +2,106 @@
 
 #include "mdnssd.h"
 
-#if !defined(_WIN32)
+#if defined(_WIN32)
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define THREAD_FUNC(f) DWORD WINAPI f(void *arg)
+#define thread_create(t, f, a)	((*(t) = CreateThread(NULL, 0, f, a, 0, NULL)) != NULL)
+#define thread_join(t)			(WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define mutex_init(m)			InitializeCriticalSection(m)
+#define mutex_destroy(m)		DeleteCriticalSection(m)
+#define mutex_lock(m)			EnterCriticalSection(m)
+#define mutex_unlock(m)			LeaveCriticalSection(m)
+#define cond_init(c)			InitializeConditionVariable(c)
+#define cond_destroy(c)
+#define cond_broadcast(c)		WakeAllConditionVariable(c)
+#define ATOMIC_INC(p)			InterlockedIncrement((volatile LONG*) (p))
+#define ATOMIC_DEC(p)			InterlockedDecrement(p)
+#define ATOMIC_LOAD(p)			InterlockedCompareExchange((volatile LONG*) (p), 0, 0)
+#define ATOMIC_STORE(p, v)		InterlockedExchange(p, v)
+#define ATOMIC_CAS(p, o, n)		(InterlockedCompareExchange(p, n, o) == (o))
+#define ATOMIC_LOAD_PTR(p)		InterlockedCompareExchangePointer((PVOID volatile*) (p), NULL, NULL)
+#define ATOMIC_XCHG_PTR(p, v)	InterlockedExchangePointer((PVOID volatile*) (p), v)
+#define ATOMIC_FENCE()			MemoryBarrier()
+#define yield()					Sleep(0)
+#define would_block()			(WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#include <pthread.h>
+#include <sched.h>
 #define closesocket close
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define THREAD_FUNC(f) void *f(void *arg)
+#define thread_create(t, f, a)	(!pthread_create(t, NULL, f, a))
+#define thread_join(t)			pthread_join(t, NULL)
+#define mutex_init(m)			pthread_mutex_init(m, NULL)
+#define mutex_destroy(m)		pthread_mutex_destroy(m)
+#define mutex_lock(m)			pthread_mutex_lock(m)
+#define mutex_unlock(m)			pthread_mutex_unlock(m)
+#define cond_init(c)			pthread_cond_init(c, NULL)
+#define cond_destroy(c)			pthread_cond_destroy(c)
+#define cond_broadcast(c)		pthread_cond_broadcast(c)
+#define ATOMIC_INC(p)			__atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_DEC(p)			__atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD(p)			__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, o, n)		__sync_bool_compare_and_swap(p, o, n)
+#define ATOMIC_LOAD_PTR(p)		__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ATOMIC_XCHG_PTR(p, v)	__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_FENCE()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define yield()					sched_yield()
+#define would_block()			(errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
 
 #ifndef TTL_MIN
 #define TTL_MIN	120
 #endif
 
+// targeted resolution of missing records: initial delay (ms), retries and questions/pass
+#define RESOLVE_DELAY	20
+#define RESOLVE_TRIES	3
+#define RESOLVE_MAX		32
+
+// records refreshed together when their refresh points are within window (s)
+#define REFRESH_WINDOW	2
+#define REFRESH_MAX		64
+
+// fingerprints of records already in cache (power of 2)
+#define FP_SLOTS		256
+#define FNV_OFFSET		1469598103934665603ULL
+#define FNV_PRIME		1099511628211ULL
+
+// sources tracked for rate limiting and datagrams handled in one input step
+#define RATE_SLOTS		64
+#define RATE_PROBES		4
+#define RECV_BUDGET		64
+
 #define DNS_HEADER_SIZE (12)
 #define DNS_MAX_HOSTNAME_LENGTH (253)
 #define DNS_MAX_LABEL_LENGTH (63)
 #define MDNS_MULTICAST_ADDRESS "224.0.0.251"
+#define MDNS_MULTICAST_ADDRESS6 "ff02::fb"
 #define MDNS_PORT (5353)
 #define DNS_BUFFER_SIZE (32768)
 #define MDNS_IGMP_HOST_MEMBERSHIP_REPORT (0x16)
 
 // TODO find the right number for this
 #define DNS_MESSAGE_MAX_SIZE (4096)
+// don't build queries that would be fragmented
+#define MDNS_PACKET_SIZE (1440)
 
 // DNS Resource Record types
 // (RFC 1035 section 3.2.2)
+#define DNS_CLASS_FLUSH (0x8000)
 #define DNS_RR_TYPE_A (1)
 #define DNS_RR_TYPE_CNAME (5)
 #define DNS_RR_TYPE_PTR (12)
 #define DNS_RR_TYPE_TXT (16)
 #define DNS_RR_TYPE_SRV (33)
+#define DNS_RR_TYPE_AAAA (28)
 
 // TODO not sure about this
 #define MAX_RR_NAME_SIZE (256)
@@ -75,6 +149,8 @@ typedef struct {
   uint32_t ttl;
   uint16_t rdata_length;
   void* rdata;
+  bool cache_flush;
+  uint64_t fp;
 } mDNSResourceRecord;
 
 typedef struct slist_s {
@@ -83,23 +159,215 @@ typedef struct slist_s {
   struct ttl_timing_s {
 	  uint32_t last, wake;
 	  uint32_t ttl;
+	  // fingerprint of the record this has been last set from
+	  uint64_t fp;
   } rr_srv, rr_ptr, rr_txt;
+  struct {
+	  uint64_t next;
+	  int tries, asked;
+  } resolve;
   char *name, *hostname;
-  struct in_addr addr, host;
-  uint16_t port;
+  // source of the records, an IPv4 one is v4-mapped
+  struct in6_addr host;
+  // interface (index in handle) it has been seen on, shadow when another
+  // interface already reports the same service
+  int iface;
+  struct in_addr local;
+  // index of that interface, the scope of link-local IPv6 addresses
+  unsigned scope6;
+  bool shadow;
+  // copy of the host's address sets when service was last reported
+  struct in_addr *addrs;
+  int addr_count;
+  struct in6_addr *addrs6;
+  int addr6_count;
+  uint16_t port, priority, weight;
   int txt_length;
   char *txt;
+  // departed services are held until tomb, flaps makes that hold longer
+  uint32_t tomb, flapped;
+  int flaps;
+  // only kept for a direct resolution, never reported by discovery
+  bool direct;
+  // rejected by filters (so also a shadow)
+  bool filtered;
+  // what is accounted in cache size (0 until in cache)
+  size_t bytes;
 } slist_t;
 
+// reported instances of a browsed type by priority, zero weights first within
+// one, kept in order as they come and go for weighted selection (RFC2782)
+typedef struct rank_s {
+  struct rank_s *next;
+  char *type;
+  slist_t **entries;
+  int count, size;
+} rank_t;
+
+// compiled predicate on cached records, all must pass for a service to be reported
+typedef struct filter_s {
+  struct filter_s *next;
+  enum { FILTER_TXT, FILTER_PORT, FILTER_SUBNET } type;
+  // TXT key and value (NULL when only key must be present)
+  char *key, *value;
+  uint16_t min, max;
+  struct in_addr net, mask;
+} filter_t;
+
+// pending direct resolution of an instance or a host
+typedef struct lookup_s {
+  struct lookup_s *next;
+  char *name;
+  bool host;
+  uint64_t next_ask, deadline;
+  int tries;
+  mdnssd_resolve_cb_t *callback;
+  void *cookie;
+} lookup_t;
+
+// another type browsed by the same handle, asked once when added
+typedef struct browse_s {
+  struct browse_s *next;
+  char *name;
+  bool asked;
+} browse_t;
+
+// service type answering the meta-query, with hashes of its instances
+// names when they are counted
+typedef struct tlist_s {
+  struct tlist_s *next;
+  char *name;
+  struct ttl_timing_s rr;
+  uint64_t *instances;
+  int count;
+  bool asked;
+} tlist_t;
+
 typedef struct alist_s {
   struct alist_s *next;
-  struct ttl_timing_s rr;
   char *name;
-  struct in_addr addr;
+  int iface;
+  // all addresses of the host, ascending order, each with its own ttl
+  int count;
+  struct a_addr_s {
+	struct in_addr addr;
+	struct ttl_timing_s rr;
+  } *addrs;
+  // same from AAAA
+  int count6;
+  struct aaaa_addr_s {
+	struct in6_addr addr;
+	struct ttl_timing_s rr;
+  } *addrs6;
+  int used;				// services using it (when evicting)
+  bool bye;				// an address said goodbye (ttl = 0) at last pass
+  size_t bytes;			// accounted in cache size (0 until in cache)
 } alist_t;
 
+// persisted cache, used mapped as is: header, services, hosts, addresses then
+// strings (names and raw TXT), offsets are from start of file, ttl are what was
+// left when saved (wall clock) and interfaces are identified by their address
+#define PERSIST_MAGIC	0x4d444e43
+#define PERSIST_VERSION	1
+
+typedef struct persist_header_s {
+  uint32_t magic, version;
+  uint32_t saved, size;
+  uint32_t services, hosts, addrs, addrs6;
+  uint32_t strings;
+} persist_header_t;
+
+typedef struct persist_service_s {
+  uint32_t name, hostname, txt, txt_length;
+  uint8_t host[16];
+  uint32_t local;
+  uint16_t port, priority, weight, v6;
+  uint32_t ptr, srv, txt_ttl;
+} persist_service_t;
+
+typedef struct persist_host_s {
+  uint32_t name, local, v6;
+  uint32_t first, count, first6, count6;
+} persist_host_t;
+
+typedef struct persist_addr_s {
+  uint32_t addr, ttl;
+} persist_addr_t;
+
+typedef struct persist_addr6_s {
+  uint8_t addr[16];
+  uint32_t ttl;
+} persist_addr6_t;
+
+// table published in shared memory for local readers: header, services, addresses
+// then strings, offsets are from start of segment. Writer makes seq odd while it
+// updates, readers copy out and retry when seq was odd or has moved (seqlock).
+// A segment never shrinks, so readers remap when it has grown past their view
+#define SHARED_MAGIC	0x4d444e53
+#define SHARED_VERSION	1
+#define SHARED_SIZE		(256*1024)
+#define SHARED_TRIES	1000
+
+typedef struct shared_header_s {
+  uint32_t magic, version;
+  volatile int32_t seq;
+  uint32_t size, used;
+  uint32_t count, dropped;
+  uint32_t published;
+} shared_header_t;
+
+typedef struct shared_service_s {
+  uint32_t name, hostname, txt, txt_length;
+  uint8_t host[16];
+  uint32_t iface, scope6;
+  uint16_t port, priority, weight, pad;
+  uint32_t since, flaps;
+  uint32_t addrs, addr_count, addrs6, addr6_count;
+} shared_service_t;
+
+struct mdnssd_shared_s {
+  char *name;
+  char *data;
+  size_t size;
+  void *map;
+};
+
+// cache entries in eviction order: never reported first, then least refreshed
+typedef struct victim_s {
+  bool reported;
+  uint32_t last;
+  slist_t *s;
+  alist_t *a;
+} victim_t;
+
+// published table and its reference count (readers only see the table)
+typedef struct snapshot_s {
+  mdnssd_snapshot_t table;			// must be first
+  volatile long refs;
+} snapshot_t;
+
 typedef struct mdnssd_handle_s {
-	int sock;
+	// one socket per interface, all polled together, IPv6 ones (if any) are
+	// after and carry the IPv4 address of the same interface
+	int iface_count;
+	struct iface_s {
+		int sock;
+		struct in_addr host;
+		unsigned index;
+		bool v6;
+		// link is down or address is gone, name is kept to follow re-creation
+		bool down;
+		char name[16];
+	} ifaces[MDNS_MAX_IFACES * 2];
+	// how sockets have been opened, ipv6 is when some are
+	bool compliant, ipv6;
+	// link and address changes (rtnetlink, Linux only), -1 if none
+	int netlink;
+	// all state is per handle so that they can run in parallel
+	int debug;
+	mdnssd_log_t *log;
+	void *log_cookie;
+	char *recvdata;
 	enum { MDNS_IDLE, MDNS_RUNNING } state;
 	mdnssd_control_e control;
 	struct context_s {
@@ -107,7 +375,123 @@ typedef struct mdnssd_handle_s {
 		slist_t* slist;
 		alist_t* alist;
 		uint32_t srecords, arecords;
+		bool goodbye;
+		filter_t *filters;
+		rank_t *ranks;
+		uint32_t seed;
+		// other browsed types, and service types enumeration (meta-query)
+		browse_t *browses;
+		struct {
+			bool on, count;
+			char **wanted;
+			tlist_t *types;
+		} enumerate;
+		struct {
+			uint32_t grace, max;
+		} damping;
+		struct {
+			uint32_t entries;
+			size_t bytes;
+		} limits;
+		size_t bytes;
+		uint32_t evictions;
+		// a service was held or came back, tables must be published again
+		bool held;
+		// records recently stored (or ignored when owner is NULL)
+		struct fingerprint_s {
+			uint64_t hash;
+			void *owner;
+			uint16_t type;
+			union {
+				struct in_addr v4;
+				struct in6_addr v6;
+			} addr;
+		} fingerprints[FP_SLOTS];
 	} context;
+	// direct resolutions in flight
+	lookup_t *lookups;
+	// warm-start file, loaded when query opens, saved on close and every interval
+	struct persist_s {
+		char *path;
+		uint32_t interval, next;
+		bool pending;
+	} persist;
+	// table published for other processes, updated whenever something changed
+	struct shared_s {
+		char *name;
+		char *data;
+		size_t size;
+		void *map;
+	} shared;
+	// managed (background) discovery
+	struct thread_s {
+		bool running;
+		thread_t thread;
+		char *query;
+		bool unicast;
+		mdns_callback_t *callback;
+		void *cookie;
+		// snapshot is swapped by the thread, readers are tracked per epoch
+		snapshot_t* volatile snapshot;
+		volatile long epoch, readers[2];
+		uint32_t version;
+	} managed;
+	// optional queue to run callbacks on a consumer thread
+	struct dispatch_s {
+		bool running;
+		mdnssd_overflow_e policy;
+		thread_t thread;
+		mutex_t mutex;
+		cond_t cond;
+		volatile long waiting;
+		// each batch carries the callback of the query that produced it
+		struct cell_s {
+			volatile long seq;
+			mdnssd_service_t *data;
+			mdns_callback_t *callback;
+			void *cookie;
+		} *cells;
+		long mask;
+		// done counts batches delivered or dropped, it catches up with head when idle
+		volatile long head, tail, done;
+		mdnssd_service_t *pending;
+		volatile long max, drops, coalesced;
+		// stop requested by a callback, picked up by the query loop
+		volatile long stop;
+	} dispatch;
+	// changes accumulated before callback
+	struct coalesce_s {
+		int window, count;
+		int events;
+		uint64_t first;
+		mdnssd_service_t *list;
+	} coalesce;
+	struct counters_s {
+		uint32_t unicast, multicast;
+		uint32_t qu, qm;
+		uint32_t rejoins;
+	} counters;
+	// per-source token buckets (tokens are 1/1000 of a datagram)
+	struct limiter_s {
+		uint32_t rate, burst;
+		uint32_t drops;
+		struct bucket_s {
+			struct in6_addr addr;
+			uint32_t tokens, drops;
+			uint64_t last;
+		} buckets[RATE_SLOTS], fresh;
+	} limiter;
+	// query loop state, can be stepped by caller
+	struct loop_s {
+		// qu is set when next browse opens a discovery (startup or reset)
+		bool unicast, qu, blocking, stop;
+		// interface of the datagram being parsed
+		int iface;
+		mdns_callback_t *callback;
+		void *cookie;
+		uint32_t wake, last;
+		uint64_t resolve;
+	} loop;
 } mdnssd_handle_t;
 
 typedef struct item_s {
@@ -124,35 +508,114 @@ static item_t *insert_tail_item(item_t *item, item_t **list);
 */
 static void   clear_list(item_t *list, void (*clean)(void *));
 
-static void store_a(struct context_s *context, mDNSResourceRecord* rr);
-static void store_other(struct in_addr host, struct context_s *context, char *message, mDNSResourceRecord* rr);
+static void store_a(mdnssd_handle_t *handle, mDNSResourceRecord* rr);
+static void store_aaaa(mdnssd_handle_t *handle, mDNSResourceRecord* rr);
+static void store_other(mdnssd_handle_t *handle, struct in6_addr host, char *message, mDNSResourceRecord* rr);
+static void flush_s(struct context_s *context, slist_t *owner, uint32_t now);
+static void flush_a(alist_t *a, bool v6, int keep, uint32_t now);
+static alist_t *find_a(struct context_s* context, char *name, int iface);
+static bool sync_addrs(slist_t *s, alist_t *a);
+static bool revive_s(struct context_s *context, slist_t *s, uint32_t now);
+static void account_s(struct context_s *context, slist_t *s);
+static void account_a(struct context_s *context, alist_t *a);
+static void discount_s(struct context_s *context, slist_t *s);
+static void discount_a(struct context_s *context, alist_t *a);
+static bool over_limits(struct context_s *context);
+static void evict_cache(struct context_s *context, uint32_t now, mdnssd_service_t **services);
 
-static int debug(const char* format, ...);
+static int debug(mdnssd_handle_t *handle, const char* format, ...);
 
-static mDNSFlags* mdns_parse_header_flags(uint16_t data);
+static mDNSFlags* mdns_parse_header_flags(mdnssd_handle_t *handle, uint16_t data);
 static uint16_t mdns_pack_header_flags(mDNSFlags flags);
-static char* mdns_pack_question(mDNSQuestion* q, size_t* size);
-static void mdns_message_print(mDNSMessage* msg);
-static mDNSMessage* mdns_build_query_message(char* query, uint16_t query_type, bool unicast);
-static char* mdns_pack_message(mDNSMessage* msg, size_t* pack_length);
+static char* mdns_pack_question(mdnssd_handle_t *handle, mDNSQuestion* q, size_t* size);
+static char* mdns_pack_answer(mdnssd_handle_t *handle, mDNSResourceRecord* rr, size_t* size);
+static void mdns_message_print(mdnssd_handle_t *handle, mDNSMessage* msg);
+static mDNSMessage* mdns_build_query_message(mdnssd_handle_t *handle, mDNSQuestion* questions, int count,
+											 mDNSResourceRecord* answers, int an_count);
+static char* mdns_pack_message(mdnssd_handle_t *handle, mDNSMessage* msg, size_t* pack_length);
 
-static int mdns_parse_question(char* message, char* data, int size);
+static int mdns_parse_question(mdnssd_handle_t *handle, char* message, char* data, int size);
 
-static int mdns_parse_rr_a(char* data, struct in_addr *addr);
-static int mdns_parse_rr_ptr(char* message, char* data, char **name);
-static int mdns_parse_rr_srv(char* message, char* data, char **hostname, unsigned short *port);
+static int mdns_parse_rr_a(mdnssd_handle_t *handle, char* data, struct in_addr *addr);
+static int mdns_parse_rr_aaaa(mdnssd_handle_t *handle, char* data, int length, struct in6_addr *addr);
+static int mdns_parse_rr_ptr(mdnssd_handle_t *handle, char* message, char* data, char **name);
+static int mdns_parse_rr_srv(mdnssd_handle_t *handle, char* message, char* data, char **hostname, unsigned short *port,
+							 uint16_t *priority, uint16_t *weight);
 static void mdns_parse_rr_txt(char* message, mDNSResourceRecord* rr, char **txt, int *length);
-static int mdns_parse_rr(struct in_addr host, struct context_s *context, char* message, char* rrdata, int size, int is_answer);
-static int mdns_parse_message_net(struct in_addr host, struct context_s *context, char* data, int size, mDNSMessage* msg);
-static char* parse_rr_name(char* message, char* name, int *parsed);
+static int mdns_parse_rr(mdnssd_handle_t *handle, struct in6_addr host, char* message, char* rrdata, int size, int is_answer);
+static int mdns_parse_message_net(mdnssd_handle_t *handle, struct in6_addr host, char* data, int size, mDNSMessage* msg);
+static char* parse_rr_name(mdnssd_handle_t *handle, char* message, char* name, int *parsed);
 
 static uint16_t get_offset(char* data);
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length);
+static int hash_name(char *message, char *end, char *name, uint64_t *hash);
+static int mdns_refresh_rr(mdnssd_handle_t *handle, struct in6_addr host, char* message, char* rrdata, int size, uint64_t *fp);
+static void remember_fp(struct context_s *context, uint64_t hash, void *owner, uint16_t type, const void *addr);
+static void forget_fp(struct context_s *context, void *owner);
 
 static void free_resource_record(mDNSResourceRecord* rr);
 static void clear_context(struct context_s *context);
+static void free_handle(mdnssd_handle_t *handle);
+static mdnssd_service_t *copy_service(mdnssd_service_t *s);
+static mdnssd_service_t *build_service(slist_t *s, uint32_t now, bool expired);
+static void publish_snapshot(mdnssd_handle_t *handle, snapshot_t *snapshot);
+static void update_snapshot(mdnssd_handle_t *handle);
+static void dispatch(mdnssd_handle_t *handle, mdnssd_service_t *slist);
+static void deliver(mdnssd_handle_t *handle, mdnssd_service_t *slist);
+static void flush_coalesce(mdnssd_handle_t *handle);
+static void drain_dispatch(mdnssd_handle_t *handle);
+static void stop_dispatch(mdnssd_handle_t *handle);
+static void merge_services(mdnssd_service_t **list, mdnssd_service_t *add);
 
-static char* prepare_query_string(const char* name);
-static int send_query(int sock, const char* query, uint16_t query_type, bool unicast);
+static char* prepare_query_string(mdnssd_handle_t *handle, const char* name);
+static int recv_packet(mdnssd_handle_t *handle, int iface, struct in6_addr *from, bool *unicast);
+static int open_socket6(mdnssd_handle_t *handle, unsigned index, bool compliant);
+static struct in6_addr source_addr(struct sockaddr_storage *addr);
+static struct in_addr source_v4(struct in6_addr *host);
+static int open_socket(mdnssd_handle_t *handle, struct in_addr host, bool compliant);
+static int get_ifaces(struct in_addr *hosts, unsigned *index, int max);
+static int open_netlink(mdnssd_handle_t *handle);
+static void process_netlink(mdnssd_handle_t *handle);
+static void rejoin_iface(mdnssd_handle_t *handle, struct iface_s *iface);
+static void change_iface(mdnssd_handle_t *handle, int iface, bool up, struct in_addr host);
+static void flush_iface(struct context_s *context, int iface, uint32_t now);
+static bool is_shadow(struct context_s *context, slist_t *s);
+static const char *parent_type(const char *type);
+static int match_rank(const char *type, const char *name, bool ptr);
+static const char *match_type(struct context_s *context, const char *name, bool ptr);
+static bool store_type(mdnssd_handle_t *handle, char *message, mDNSResourceRecord *rr);
+static bool add_browse(mdnssd_handle_t *handle, const char *type);
+static void forget_ignored(struct context_s *context);
+static void free_t(tlist_t *t);
+static lookup_t *find_lookup(mdnssd_handle_t *handle, const char *name, bool host);
+static bool add_lookup(mdnssd_handle_t *handle, const char *name, bool host, int timeout, mdnssd_resolve_cb_t *callback, void *cookie);
+static void check_lookups(mdnssd_handle_t *handle);
+static mdnssd_service_t *resolve_cached(struct context_s *context, const char *name, bool host, uint32_t now);
+static bool match_filters(struct context_s *context, slist_t *s);
+static void report_s(struct context_s *context, slist_t *s, uint32_t now, mdnssd_service_t **services);
+static void rank_s(struct context_s *context, slist_t *s);
+static void unrank_s(struct context_s *context, slist_t *s);
+static void free_rank(rank_t *r);
+static char *map_file(const char *path, size_t *size);
+static void unmap_file(char *data, size_t size);
+static const char *persist_string(char *data, size_t size, uint32_t offset);
+static int find_iface(mdnssd_handle_t *handle, uint32_t local, bool v6);
+static uint32_t ttl_left(struct ttl_timing_s *t, uint32_t now);
+static void load_cache(mdnssd_handle_t *handle);
+static bool save_cache(mdnssd_handle_t *handle);
+static char *open_shared(const char *name, size_t *size, bool create, void **map);
+static void close_shared(const char *name, char *data, size_t size, void *map, bool owner);
+static void publish_shared(mdnssd_handle_t *handle);
+static void stop_publish(mdnssd_handle_t *handle);
+static bool remap_shared(mdnssd_shared_t *shared);
+static void refilter_cache(mdnssd_handle_t *handle);
+static void free_filters(mdnssd_handle_t *handle);
+static void promote_s(struct context_s *context, slist_t *s, uint32_t now, mdnssd_service_t **services);
+static bool can_configure(mdnssd_handle_t *handle);
+static bool ask_unicast(mdnssd_handle_t *handle);
+static bool rate_check(mdnssd_handle_t *handle, struct in6_addr addr, uint64_t now);
+static bool take_token(struct limiter_s *l, struct bucket_s *b, uint64_t now);
+static int send_questions(mdnssd_handle_t *handle, mDNSQuestion* questions, int count, mDNSResourceRecord* answers, int an_count);
 
 
 
@@ -32,12 +32,18 @@
 
 */
 
+// in6_pktinfo is a GNU extension of glibc
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <ctype.h>
 
 #include "mdnssd.h"
 #include "mdnssd-core.h"
@@ -45,25 +51,34 @@
 #ifndef _WIN32
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <ifaddrs.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #endif
 
 #if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
 #include <sys/time.h>
 #endif
 
-// is debug mode enabled?
-static int debug_mode;
-
 /*---------------------------------------------------------------------------*/
-static int debug(const char* format, ...) {
+static int debug(mdnssd_handle_t *handle, const char* format, ...) {
   va_list args;
-  int ret;
+  int ret = 0;
 
-  if(!debug_mode) {
+  // debug mode is per handle, no global state
+  if(!handle->debug) {
 	return 0;
   }
   va_start(args, format);
-  ret = vfprintf(stderr, format, args);
+  if (handle->log) (*handle->log)(handle->log_cookie, format, args);
+  else ret = vfprintf(stderr, format, args);
 
   va_end(args);
   return ret;
@@ -71,23 +86,29 @@ static int debug(const char* format, ...) {
 
 
 /*---------------------------------------------------------------------------*/
-static uint32_t gettime(void) {
+static uint64_t gettime_ms(void) {
 #ifdef _WIN32
-	return GetTickCount64() / 1000;
+	return GetTickCount64();
 #else
 #if defined(__linux__) || defined(__FreeBSD__)
 	struct timespec ts;
 	if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
-		return ts.tv_sec;
+		return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 	}
 #endif
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	return tv.tv_sec;
+	return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
 #endif
 }
 
 
+/*---------------------------------------------------------------------------*/
+static uint32_t gettime(void) {
+	return gettime_ms() / 1000;
+}
+
+
 /*---------------------------------------------------------------------------*/
 static item_t *insert_item(item_t *item, item_t **list) {
   if (*list) item->next = *list;
@@ -161,6 +182,8 @@ static void clear_list(item_t *list, void (*free_func)(void *)) {
 /*---------------------------------------------------------------------------*/
 static void free_a(alist_t* a) {
 	if (a->name) free(a->name);
+	if (a->addrs) free(a->addrs);
+	if (a->addrs6) free(a->addrs6);
 	free(a);
 }
 
@@ -170,12 +193,22 @@ static void free_s(slist_t* s) {
 	if (s->name) free(s->name);
 	if (s->hostname) free(s->hostname);
 	if (s->txt) free(s->txt);
+	if (s->addrs) free(s->addrs);
+	if (s->addrs6) free(s->addrs6);
 	free(s);
 }
 
 
 /*---------------------------------------------------------------------------*/
-static char* prepare_query_string(const char* name) {
+static void free_t(tlist_t* t) {
+	if (t->name) free(t->name);
+	if (t->instances) free(t->instances);
+	free(t);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static char* prepare_query_string(mdnssd_handle_t *handle, const char* name) {
   int i;
   int count;
   int lastdot = 0;
@@ -184,7 +217,7 @@ static char* prepare_query_string(const char* name) {
 
   result = malloc(len + 2);
   if(!result) {
-	debug("failed to allocate memory for parsed hostname");
+	debug(handle, "failed to allocate memory for parsed hostname");
 	return NULL;
   }
 
@@ -207,11 +240,11 @@ static char* prepare_query_string(const char* name) {
 
 // expects host byte_order
 /*---------------------------------------------------------------------------*/
-static mDNSFlags* mdns_parse_header_flags(uint16_t data) {
+static mDNSFlags* mdns_parse_header_flags(mdnssd_handle_t *handle, uint16_t data) {
   mDNSFlags* flags = malloc(sizeof(mDNSFlags));
 
   if(!flags) {
-	debug("could not allocate memory for parsing header flags");
+	debug(handle, "could not allocate memory for parsing header flags");
 	return NULL;
   }
 
@@ -251,7 +284,7 @@ static uint16_t mdns_pack_header_flags(mDNSFlags flags) {
 
 
 /*---------------------------------------------------------------------------*/
-static char* mdns_pack_question(mDNSQuestion* q, size_t* size) {
+static char* mdns_pack_question(mdnssd_handle_t *handle, mDNSQuestion* q, size_t* size) {
   char* packed;
   size_t name_length;
   uint16_t qtype;
@@ -260,18 +293,18 @@ static char* mdns_pack_question(mDNSQuestion* q, size_t* size) {
 
   name_length = strlen(q->qname) + 1;
   if(name_length > DNS_MAX_HOSTNAME_LENGTH) {
-	debug("domain name too long");
+	debug(handle, "domain name too long");
 	return NULL;
   }
 
-  debug("name length: %u\n", name_length);
+  debug(handle, "name length: %u\n", name_length);
 
   *size = name_length + 2 + 2;
 
   // 1 char for terminating \0, 2 for qtype and 2 for qclass
   packed = malloc(*size);
   if(!packed) {
-	debug("could not allocate memory for DNS question");
+	debug(handle, "could not allocate memory for DNS question");
 	return NULL;
   }
 
@@ -296,18 +329,18 @@ static char* mdns_pack_question(mDNSQuestion* q, size_t* size) {
 
 // parse question section
 /*---------------------------------------------------------------------------*/
-static int mdns_parse_question(char* message, char* data, int size) {
+static int mdns_parse_question(mdnssd_handle_t *handle, char* message, char* data, int size) {
   mDNSQuestion q;
   char* cur;
   int parsed = 0;
 
   cur = data;
   // TODO check for invalid length
-  q.qname = parse_rr_name(message, data, &parsed);
+  q.qname = parse_rr_name(handle, message, data, &parsed);
   free(q.qname);
   cur += parsed;
   if(parsed > size) {
-	debug("qname is too long");
+	debug(handle, "qname is too long");
 	return 0;
   }
 
@@ -332,30 +365,30 @@ static int mdns_parse_question(char* message, char* data, int size) {
 
 
 /*---------------------------------------------------------------------------*/
-static void mdns_message_print(mDNSMessage* msg) {
+static void mdns_message_print(mdnssd_handle_t *handle, mDNSMessage* msg) {
 
-  mDNSFlags* flags = mdns_parse_header_flags(msg->flags);
+  mDNSFlags* flags = mdns_parse_header_flags(handle, msg->flags);
 
   if (!flags) return;
 /*
-  debug("ID: %u\n", msg->id);
-  debug("Flags: \n");
-  debug("      QR: %u\n", flags->qr);
-  debug("  OPCODE: %u\n", flags->opcode);
-  debug("      AA: %u\n", flags->aa);
-  debug("      TC: %u\n", flags->tc);
-  debug("      RD: %u\n", flags->rd);
-  debug("      RA: %u\n", flags->ra);
-  debug("       Z: %u\n", flags->zero);
-  debug("      AD: %u\n", flags->ad);
-  debug("      CD: %u\n", flags->cd);
-  debug("   RCODE: %u\n", flags->rcode);
-  debug("\n");
-  debug("QDCOUNT: %u\n", msg->qd_count);
-  debug("ANCOUNT: %u\n", msg->an_count);
-  debug("NSCOUNT: %u\n", msg->ns_count);
-  debug("ARCOUNT: %u\n", msg->ar_count);
-  debug("Resource records:\n");
+  debug(handle, "ID: %u\n", msg->id);
+  debug(handle, "Flags: \n");
+  debug(handle, "      QR: %u\n", flags->qr);
+  debug(handle, "  OPCODE: %u\n", flags->opcode);
+  debug(handle, "      AA: %u\n", flags->aa);
+  debug(handle, "      TC: %u\n", flags->tc);
+  debug(handle, "      RD: %u\n", flags->rd);
+  debug(handle, "      RA: %u\n", flags->ra);
+  debug(handle, "       Z: %u\n", flags->zero);
+  debug(handle, "      AD: %u\n", flags->ad);
+  debug(handle, "      CD: %u\n", flags->cd);
+  debug(handle, "   RCODE: %u\n", flags->rcode);
+  debug(handle, "\n");
+  debug(handle, "QDCOUNT: %u\n", msg->qd_count);
+  debug(handle, "ANCOUNT: %u\n", msg->an_count);
+  debug(handle, "NSCOUNT: %u\n", msg->ns_count);
+  debug(handle, "ARCOUNT: %u\n", msg->ar_count);
+  debug(handle, "Resource records:\n");
 */
   free(flags);
 }
@@ -363,27 +396,47 @@ static void mdns_message_print(mDNSMessage* msg) {
 
 // parse A resource record
 /*---------------------------------------------------------------------------*/
-static int mdns_parse_rr_a(char* data, struct in_addr *addr) {
+static int mdns_parse_rr_a(mdnssd_handle_t *handle, char* data, struct in_addr *addr) {
   addr->s_addr = INADDR_ANY;
   // ignore local link responses
   if ((data[0] == '\xa9') && (data[1] == '\xfe')) return 4;
 
   memcpy(&(addr->s_addr), data, 4);
 
-  debug("        A: %s\n", inet_ntoa(*addr));
+  if (handle->debug) {
+	char buf[INET_ADDRSTRLEN];
+	debug(handle, "        A: %s\n", inet_ntop(AF_INET, addr, buf, sizeof(buf)));
+  }
 
   return 4;
 }
 
 
+// parse AAAA resource record
+/*---------------------------------------------------------------------------*/
+static int mdns_parse_rr_aaaa(mdnssd_handle_t *handle, char* data, int length, struct in6_addr *addr) {
+  memset(addr, 0, sizeof(*addr));
+  if (length != 16) return length;
+  // link-local ones are kept, services carry the interface as their scope
+  memcpy(addr, data, 16);
+
+  if (handle->debug) {
+	char buf[INET6_ADDRSTRLEN];
+	debug(handle, "        AAAA: %s\n", inet_ntop(AF_INET6, addr, buf, sizeof(buf)));
+  }
+
+  return 16;
+}
+
+
 // parse PTR resource record
 /*---------------------------------------------------------------------------*/
-static int mdns_parse_rr_ptr(char* message, char* data, char **name) {
+static int mdns_parse_rr_ptr(mdnssd_handle_t *handle, char* message, char* data, char **name) {
   int parsed = 0;
 
-  *name = parse_rr_name(message, data, &parsed);
+  *name = parse_rr_name(handle, message, data, &parsed);
 
-  debug("        PTR: %s\n", *name);
+  debug(handle, "        PTR: %s\n", *name);
 
   return parsed;
 }
@@ -391,19 +444,17 @@ static int mdns_parse_rr_ptr(char* message, char* data, char **name) {
 
 // parse SRV resource record
 /*---------------------------------------------------------------------------*/
-static int mdns_parse_rr_srv(char* message, char* data, char **hostname, unsigned short *port) {
-  uint16_t priority;
-  uint16_t weight;
+static int mdns_parse_rr_srv(mdnssd_handle_t *handle, char* message, char* data, char **hostname, unsigned short *port,
+							 uint16_t *priority, uint16_t *weight) {
   int parsed = 0;
 
-  // TODO currently we do nothing with the priority and weight
-  memcpy(&priority, data, 2);
-  priority = ntohs(priority);
+  memcpy(priority, data, 2);
+  *priority = ntohs(*priority);
   data += 2;
   parsed += 2;
 
-  memcpy(&weight, data, 2);
-  weight = ntohs(weight);
+  memcpy(weight, data, 2);
+  *weight = ntohs(*weight);
   data += 2;
   parsed += 2;
 
@@ -412,10 +463,11 @@ static int mdns_parse_rr_srv(char* message, char* data, char **hostname, unsigne
   data += 2;
   parsed += 2;
 
-  *hostname = parse_rr_name(message, data, &parsed);
+  *hostname = parse_rr_name(handle, message, data, &parsed);
 
-  debug("        SRV target: %s\n", *hostname);
-  debug("        SRV port: %u\n", *port);
+  debug(handle, "        SRV target: %s\n", *hostname);
+  debug(handle, "        SRV port: %u\n", *port);
+  debug(handle, "        SRV priority: %u weight: %u\n", *priority, *weight);
 
   return parsed;
 }
@@ -453,7 +505,7 @@ static uint16_t get_offset(char* data) {
 // parse a domain name
 // of the type included in resource records
 /*---------------------------------------------------------------------------*/
-static char* parse_rr_name(char* message, char* name, int* parsed) {
+static char* parse_rr_name(mdnssd_handle_t *handle, char* message, char* name, int* parsed) {
 
   int dereference_count = 0;
   uint16_t offset;
@@ -466,7 +518,7 @@ static char* parse_rr_name(char* message, char* name, int* parsed) {
 
   out = malloc(MAX_RR_NAME_SIZE);
   if(!out) {
-	debug("could not allocate memory for resource record name");
+	debug(handle, "could not allocate memory for resource record name");
 	return NULL;
   }
 
@@ -533,21 +585,189 @@ static void free_resource_record(mDNSResourceRecord* rr) {
 }
 
 
+/*---------------------------------------------------------------------------*/
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+  const uint8_t *p = data;
+  while (length--) hash = (hash ^ *p++) * FNV_PRIME;
+  return hash;
+}
+
+
+// hash a (possibly compressed) name where it is, returns the bytes it takes in
+// place or 0 if malformed
+/*---------------------------------------------------------------------------*/
+static int hash_name(char *message, char *end, char *name, uint64_t *hash) {
+  int span = 0, jumps = 0;
+  bool jumped = false;
+
+  while (name >= message && name < end) {
+	uint8_t length = *name;
+
+	if ((length & 0xc0) == 0xc0) {
+	  if (name + 1 >= end || ++jumps >= MAX_DEREFERENCE_COUNT) return 0;
+	  if (!jumped) span += 2;
+	  jumped = true;
+	  name = message + (((length & 0x3f) << 8) | (uint8_t) name[1]);
+	  continue;
+	}
+
+	if (name + 1 + length > end) return 0;
+	*hash = hash_bytes(*hash, name, length + 1);
+	if (!jumped) span += length + 1;
+	if (!length) return span;
+	name += length + 1;
+  }
+
+  return 0;
+}
+
+
+/*
+  Same answers keep coming (announcements, responses to others...) so the
+  fingerprint of a record is checked against what has been stored before. When
+  it matches, only ttl is refreshed, nothing is decoded or allocated. Returns
+  the bytes parsed when done, 0 otherwise with fp set for the slow path
+ */
+/*---------------------------------------------------------------------------*/
+static int mdns_refresh_rr(mdnssd_handle_t *handle, struct in6_addr host, char* message, char* rrdata, int size, uint64_t *fp) {
+  struct context_s *context = &handle->context;
+  struct fingerprint_s *f;
+  struct ttl_timing_s *t = NULL;
+  char *end = rrdata + size, *rdata;
+  uint16_t type, class, length;
+  uint32_t ttl, now;
+  uint64_t hash = FNV_OFFSET;
+  bool flush;
+  int span;
+
+  *fp = 0;
+  span = hash_name(message, end, rrdata, &hash);
+  if (!span || span + 10 > size) return 0;
+
+  memcpy(&type, rrdata + span, 2);
+  memcpy(&class, rrdata + span + 2, 2);
+  memcpy(&ttl, rrdata + span + 4, 4);
+  memcpy(&length, rrdata + span + 8, 2);
+  type = ntohs(type);
+  class = ntohs(class);
+  ttl = ntohl(ttl);
+  length = ntohs(length);
+  rdata = rrdata + span + 10;
+  if (rdata + length > end) return 0;
+
+  // cache-flush is not part of the record
+  flush = (class & DNS_CLASS_FLUSH) != 0;
+  class &= ~DNS_CLASS_FLUSH;
+  hash = hash_bytes(hash, &type, sizeof(type));
+  hash = hash_bytes(hash, &class, sizeof(class));
+
+  switch (type) {
+	case DNS_RR_TYPE_PTR:
+	  if (!hash_name(message, end, rdata, &hash)) return 0;
+	  break;
+	case DNS_RR_TYPE_SRV:
+	  if (length < 7) return 0;
+	  hash = hash_bytes(hash, rdata, 6);
+	  if (!hash_name(message, end, rdata + 6, &hash)) return 0;
+	  break;
+	case DNS_RR_TYPE_TXT:
+	case DNS_RR_TYPE_A:
+	case DNS_RR_TYPE_AAAA:
+	  hash = hash_bytes(hash, rdata, length);
+	  break;
+	default:
+	  return 0;
+  }
+
+  // A/AAAA are cached by name only, others are per host, all are per interface
+  if (type != DNS_RR_TYPE_A && type != DNS_RR_TYPE_AAAA) hash = hash_bytes(hash, &host, sizeof(host));
+  hash = hash_bytes(hash, &handle->loop.iface, sizeof(handle->loop.iface));
+  *fp = hash;
+
+  // goodbyes go through the normal path
+  f = context->fingerprints + (hash & (FP_SLOTS - 1));
+  if (!ttl || f->hash != hash || f->type != type) return 0;
+
+  // something we have chosen to ignore
+  if (!f->owner) return span + 10 + length;
+
+  now = gettime();
+
+  if (type == DNS_RR_TYPE_A) {
+	alist_t *a = f->owner;
+	int i;
+	for (i = 0; i < a->count && a->addrs[i].addr.s_addr != f->addr.v4.s_addr; i++);
+	if (i == a->count) return 0;
+	t = &a->addrs[i].rr;
+	if (t->fp != hash) return 0;
+	if (flush) flush_a(a, false, i, now);
+  } else if (type == DNS_RR_TYPE_AAAA) {
+	alist_t *a = f->owner;
+	int i;
+	for (i = 0; i < a->count6 && memcmp(&a->addrs6[i].addr, &f->addr.v6, sizeof(struct in6_addr)); i++);
+	if (i == a->count6) return 0;
+	t = &a->addrs6[i].rr;
+	if (t->fp != hash) return 0;
+	if (flush) flush_a(a, true, i, now);
+  } else {
+	slist_t *s = f->owner;
+	if (type == DNS_RR_TYPE_PTR) t = &s->rr_ptr;
+	else if (type == DNS_RR_TYPE_SRV) t = &s->rr_srv;
+	else t = &s->rr_txt;
+	if (t->fp != hash) return 0;
+	if (flush && type != DNS_RR_TYPE_PTR) flush_s(context, s, now);
+  }
+
+  t->last = now;
+  t->ttl = ttl;
+  t->wake = 0;
+
+  debug(handle, "    known record type %u refreshed\n", type);
+  return span + 10 + length;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void remember_fp(struct context_s *context, uint64_t hash, void *owner, uint16_t type, const void *addr) {
+  struct fingerprint_s *f = context->fingerprints + (hash & (FP_SLOTS - 1));
+  if (!hash) return;
+  f->hash = hash;
+  f->owner = owner;
+  f->type = type;
+  // addresses tell which one of the host is refreshed
+  if (type == DNS_RR_TYPE_A) memcpy(&f->addr.v4, addr, sizeof(struct in_addr));
+  else if (type == DNS_RR_TYPE_AAAA) memcpy(&f->addr.v6, addr, sizeof(struct in6_addr));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void forget_fp(struct context_s *context, void *owner) {
+  for (int i = 0; i < FP_SLOTS; i++) {
+	if (context->fingerprints[i].owner == owner) context->fingerprints[i].hash = 0;
+  }
+}
+
+
 // parse a resource record
 // the answer, authority and additional sections all use the resource record format
 /*---------------------------------------------------------------------------*/
-static int mdns_parse_rr(struct in_addr host, struct context_s *context, char* message, char* rrdata, int size, int is_answer) {
+static int mdns_parse_rr(mdnssd_handle_t *handle, struct in6_addr host, char* message, char* rrdata, int size, int is_answer) {
   mDNSResourceRecord rr;
   int parsed = 0;
   char* cur = rrdata;
+  uint64_t fp = 0;
+
+  // repeated answers only refresh what is in cache
+  if (is_answer && (parsed = mdns_refresh_rr(handle, host, message, rrdata, size, &fp)) > 0) return parsed;
 
   rr.name = NULL;
+  rr.fp = fp;
 
-  rr.name = parse_rr_name(message, rrdata, &parsed);
+  rr.name = parse_rr_name(handle, message, rrdata, &parsed);
   if(!rr.name) {
 	// TODO are calling functions dealing with this correctly?
 	free_resource_record(&rr);
-	debug("parsing resource record name failed\n");
+	debug(handle, "parsing resource record name failed\n");
 	return 0;
   }
 
@@ -560,17 +780,20 @@ static int mdns_parse_rr(struct in_addr host, struct context_s *context, char* m
 	return 0;
   }
 
-  debug("      Resource Record Name: %s\n", rr.name);
+  debug(handle, "      Resource Record Name: %s\n", rr.name);
   
   memcpy(&(rr.type), cur, 2);
   rr.type = ntohs(rr.type);
   cur += 2;
   parsed += 2;
 
-  debug("      Resource Record Type: %u\n", rr.type);
+  debug(handle, "      Resource Record Type: %u\n", rr.type);
   
   memcpy(&(rr.class), cur, 2);
   rr.class = ntohs(rr.class);
+  // top bit of class is cache-flush for unique records (RFC6762 10.2)
+  rr.cache_flush = (rr.class & DNS_CLASS_FLUSH) != 0;
+  rr.class &= ~DNS_CLASS_FLUSH;
   cur += 2;
   parsed += 2;
 
@@ -579,7 +802,7 @@ static int mdns_parse_rr(struct in_addr host, struct context_s *context, char* m
   cur += 4;
   parsed += 4;
 
-  debug("      ttl: %u\n", rr.ttl);
+  debug(handle, "      ttl: %u\n", rr.ttl);
 
   memcpy(&(rr.rdata_length), cur, 2);
   rr.rdata_length = ntohs(rr.rdata_length);
@@ -595,13 +818,14 @@ static int mdns_parse_rr(struct in_addr host, struct context_s *context, char* m
   parsed += rr.rdata_length;
 
   if (is_answer) {
-	if (rr.type == DNS_RR_TYPE_A) store_a(context, &rr);
-	else store_other(host, context, message, &rr);
+	if (rr.type == DNS_RR_TYPE_A) store_a(handle, &rr);
+	else if (rr.type == DNS_RR_TYPE_AAAA) store_aaaa(handle, &rr);
+	else store_other(handle, host, message, &rr);
   }
 
   free_resource_record(&rr);
 
-  debug("    ------------------------------\n");
+  debug(handle, "    ------------------------------\n");
 
   return parsed;
 }
@@ -609,7 +833,7 @@ static int mdns_parse_rr(struct in_addr host, struct context_s *context, char* m
 
 // TODO this only parses the header so far
 /*---------------------------------------------------------------------------*/
-static int mdns_parse_message_net(struct in_addr host, struct context_s *context, char* data, int size, mDNSMessage* msg) {
+static int mdns_parse_message_net(mdnssd_handle_t *handle, struct in6_addr host, char* data, int size, mDNSMessage* msg) {
 
   int parsed = 0;
   int i;
@@ -627,42 +851,84 @@ static int mdns_parse_message_net(struct in_addr host, struct context_s *context
   msg->ar_count = ntohs(msg->ar_count);
   parsed += DNS_HEADER_SIZE;
 
-  mdns_message_print(msg);
+  mdns_message_print(handle, msg);
 
-  debug("  Question records [%u] (not shown)\n", msg->qd_count);
+  // known answers of queries (ours included) are not to be cached (RFC6762 7.1)
+  if (!(msg->flags & 0x8000)) {
+	debug(handle, "  Query, ignored\n");
+	return size;
+  }
+
+  debug(handle, "  Question records [%u] (not shown)\n", msg->qd_count);
   for(i=0; i < msg->qd_count; i++) {
-	parsed += mdns_parse_question(data, data+parsed, size-parsed);
+	parsed += mdns_parse_question(handle, data, data+parsed, size-parsed);
   }
 
-  debug("  Answer records [%u]\n", msg->an_count);
+  debug(handle, "  Answer records [%u]\n", msg->an_count);
   for(i=0; i < msg->an_count; i++) {
-	parsed += mdns_parse_rr(host, context, data, data+parsed, size-parsed, 1);
+	parsed += mdns_parse_rr(handle, host, data, data+parsed, size-parsed, 1);
   }
 
-  debug("  Nameserver records [%u] (not shown)\n", msg->ns_count);
+  debug(handle, "  Nameserver records [%u] (not shown)\n", msg->ns_count);
   for(i=0; i < msg->ns_count; i++) {
-	parsed += mdns_parse_rr(host, context, data, data+parsed, size-parsed, 0);
+	parsed += mdns_parse_rr(handle, host, data, data+parsed, size-parsed, 0);
   }
 
-  debug("  Additional records [%u] (not shown)\n", msg->ns_count);
+  debug(handle, "  Additional records [%u] (not shown)\n", msg->ns_count);
   for(i=0; i < msg->ar_count; i++) {
-	parsed += mdns_parse_rr(host, context, data, data+parsed, size-parsed, 1);
+	parsed += mdns_parse_rr(handle, host, data, data+parsed, size-parsed, 1);
   }
 
   return parsed;
 }
 
 
+// only PTR answers can be packed (rdata is a plain name)
+/*---------------------------------------------------------------------------*/
+static char* mdns_pack_answer(mdnssd_handle_t *handle, mDNSResourceRecord* rr, size_t* size) {
+  char *name, *rdata, *packed = NULL;
+  size_t name_length, rdata_length;
+  uint16_t type, class, length;
+  uint32_t ttl;
+
+  name = prepare_query_string(handle, rr->name);
+  rdata = prepare_query_string(handle, rr->rdata);
+
+  if (name && rdata) {
+	name_length = strlen(name) + 1;
+	rdata_length = strlen(rdata) + 1;
+	*size = name_length + 10 + rdata_length;
+	packed = malloc(*size);
+
+	type = htons(rr->type);
+	class = htons(rr->class);
+	ttl = htonl(rr->ttl);
+	length = htons(rdata_length);
+
+	memcpy(packed, name, name_length);
+	memcpy(packed + name_length, &type, 2);
+	memcpy(packed + name_length + 2, &class, 2);
+	memcpy(packed + name_length + 4, &ttl, 4);
+	memcpy(packed + name_length + 8, &length, 2);
+	memcpy(packed + name_length + 10, rdata, rdata_length);
+  }
+
+  NFREE(name);
+  NFREE(rdata);
+  return packed;
+}
+
+
 /*---------------------------------------------------------------------------*/
-static mDNSMessage* mdns_build_query_message(char* query_str, uint16_t query_type, bool unicast) {
+static mDNSMessage* mdns_build_query_message(mdnssd_handle_t *handle, mDNSQuestion* questions, int count,
+											 mDNSResourceRecord* answers, int an_count) {
   mDNSMessage* msg;
-  mDNSQuestion question;
   mDNSFlags flags;
 
   msg = malloc(sizeof(mDNSMessage));
 
   if(!msg) {
-	debug("failed to allocate memory for mDNS message");
+	debug(handle, "failed to allocate memory for mDNS message");
 	return NULL;
   }
 
@@ -679,40 +945,62 @@ static mDNSMessage* mdns_build_query_message(char* query_str, uint16_t query_typ
 
   msg->id = 0; // should be 0 for multicast query messages
   msg->flags = htons(mdns_pack_header_flags(flags));
-  msg->qd_count = htons(1); // one question
-  msg->an_count =  msg->ns_count =  msg->ar_count = 0;
-
-  question.qname = query_str;
+  msg->qd_count = htons(count);
+  msg->an_count = htons(an_count); // known answers
+  msg->ns_count =  msg->ar_count = 0;
+  msg->data = NULL;
+  msg->data_size = 0;
+
+  // questions are simply concatenated
+  for (int i = 0; i < count; i++) {
+	size_t size;
+	char *packed;
+
+	if (!questions[i].qname || (packed = mdns_pack_question(handle, questions + i, &size)) == NULL) {
+		NFREE(msg->data);
+		free(msg);
+		return NULL;
+	}
 
-  if(!question.qname) {
-	return NULL;
+	msg->data = realloc(msg->data, msg->data_size + size);
+	memcpy(msg->data + msg->data_size, packed, size);
+	msg->data_size += size;
+	free(packed);
   }
 
-  question.prefer_unicast_response = unicast;
-  question.qtype = query_type;
-  question.qclass = 1; // class for the internet (RFC 1035 section 3.2.4) but ask for unicast
+  // and so are answers
+  for (int i = 0; i < an_count; i++) {
+	size_t size;
+	char *packed;
+
+	if ((packed = mdns_pack_answer(handle, answers + i, &size)) == NULL) {
+		NFREE(msg->data);
+		free(msg);
+		return NULL;
+	}
 
-  if ((msg->data = mdns_pack_question(&question, &(msg->data_size))) == NULL) {
-	  free(msg);
-	  return NULL;
+	msg->data = realloc(msg->data, msg->data_size + size);
+	memcpy(msg->data + msg->data_size, packed, size);
+	msg->data_size += size;
+	free(packed);
   }
 
   return msg;
 }
 
 /*---------------------------------------------------------------------------*/
-static char* mdns_pack_message(mDNSMessage* msg, size_t* pack_length) {
+static char* mdns_pack_message(mdnssd_handle_t *handle, mDNSMessage* msg, size_t* pack_length) {
   char* pack;
 
   *pack_length = DNS_HEADER_SIZE + msg->data_size;
   if(*pack_length > DNS_MESSAGE_MAX_SIZE) {
-	debug("mDNS message too large");
+	debug(handle, "mDNS message too large");
 	return NULL;
   }
 
   pack = malloc(*pack_length);
   if(!pack) {
-	debug("failed to allocate data for packed mDNS message");
+	debug(handle, "failed to allocate data for packed mDNS message");
 	return NULL;
   }
 
@@ -766,38 +1054,238 @@ static void mdns_parse_txt(char *txt, int txt_length, mdnssd_service_t *s) {
 
 
 /*---------------------------------------------------------------------------*/
-static int send_query(int sock, const char* query_arg, uint16_t query_type, bool unicast) {
+static bool ask_unicast(mdnssd_handle_t *handle) {
+  return handle->loop.unicast || handle->loop.qu;
+}
+
+
+// receive one datagram and tell if it was sent to us or to the group
+/*---------------------------------------------------------------------------*/
+static int recv_packet(mdnssd_handle_t *handle, int iface, struct in6_addr *from, bool *unicast) {
+  struct sockaddr_storage addr;
+  int res;
+#if !defined(_WIN32) && (defined(IP_PKTINFO) || defined(IP_RECVDSTADDR))
+  char control[128];
+  struct iovec iov = { handle->recvdata, DNS_BUFFER_SIZE };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  *unicast = false;
+  handle->loop.iface = iface;
+  res = recvmsg(handle->ifaces[iface].sock, &msg, 0);
+  if (res < 0) return res;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#if defined(IP_PKTINFO)
+	if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+	  struct in_pktinfo *info = (struct in_pktinfo*) CMSG_DATA(cmsg);
+	  *unicast = !IN_MULTICAST(ntohl(info->ipi_addr.s_addr));
+	  // sockets share the port, so unicast can land on any of them
+	  for (int i = 0; i < handle->iface_count; i++) {
+		if (!handle->ifaces[i].v6 && handle->ifaces[i].index && handle->ifaces[i].index == (unsigned) info->ipi_ifindex) handle->loop.iface = i;
+	  }
+	}
+#else
+	if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+	  struct in_addr *dst = (struct in_addr*) CMSG_DATA(cmsg);
+	  *unicast = !IN_MULTICAST(ntohl(dst->s_addr));
+	}
+#endif
+#if defined(IPV6_PKTINFO)
+	if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+	  struct in6_pktinfo *info = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+	  *unicast = !IN6_IS_ADDR_MULTICAST(&info->ipi6_addr);
+	  for (int i = 0; i < handle->iface_count; i++) {
+		if (handle->ifaces[i].v6 && handle->ifaces[i].index && handle->ifaces[i].index == (unsigned) info->ipi6_ifindex) handle->loop.iface = i;
+	  }
+	}
+#endif
+  }
+#else
+  // no destination address available, everything accounts as multicast
+  socklen_t addrlen = sizeof(addr);
+  *unicast = false;
+  handle->loop.iface = iface;
+  res = recvfrom(handle->ifaces[iface].sock, handle->recvdata, DNS_BUFFER_SIZE, 0, (struct sockaddr *) &addr, &addrlen);
+  if (res < 0) return res;
+#endif
+
+  *from = source_addr(&addr);
+  return res;
+}
+
+
+// sources identify hosts, an IPv4 one is v4-mapped so both families share a key
+/*---------------------------------------------------------------------------*/
+static struct in6_addr source_addr(struct sockaddr_storage *addr) {
+  struct in6_addr host;
+
+  memset(&host, 0, sizeof(host));
+  if (addr->ss_family == AF_INET) {
+	host.s6_addr[10] = host.s6_addr[11] = 0xff;
+	memcpy(host.s6_addr + 12, &((struct sockaddr_in*) addr)->sin_addr, 4);
+  } else if (addr->ss_family == AF_INET6) {
+	host = ((struct sockaddr_in6*) addr)->sin6_addr;
+  }
+
+  return host;
+}
+
+
+// IPv4 part of a source, any when it is an IPv6 one
+/*---------------------------------------------------------------------------*/
+static struct in_addr source_v4(struct in6_addr *host) {
+  struct in_addr v4 = { INADDR_ANY };
+  if (IN6_IS_ADDR_V4MAPPED(host)) memcpy(&v4, host->s6_addr + 12, 4);
+  return v4;
+}
+
+
+// token bucket of source, a slot is recycled when it's the least recently used
+/*---------------------------------------------------------------------------*/
+static bool rate_check(mdnssd_handle_t *handle, struct in6_addr addr, uint64_t now) {
+  struct limiter_s *l = &handle->limiter;
+  struct bucket_s *b = NULL, *oldest = NULL;
+  uint32_t hash = hash_bytes(FNV_OFFSET, &addr, sizeof(addr)) % RATE_SLOTS;
+
+  if (!l->rate) return true;
+
+  for (int i = 0; i < RATE_PROBES && !b; i++) {
+	struct bucket_s *p = l->buckets + ((hash + i) % RATE_SLOTS);
+	if (!memcmp(&p->addr, &addr, sizeof(addr)) && p->last) b = p;
+	else if (!oldest || p->last < oldest->last) oldest = p;
+  }
+
+  // an untracked source is admitted on a budget shared by all of them and its
+  // bucket starts empty, so that rotating addresses gains nothing
+  if (!b) {
+	if (!take_token(l, &l->fresh, now)) {
+		l->drops++;
+		return false;
+	}
+	b = oldest;
+	b->addr = addr;
+	b->tokens = 0;
+	b->drops = 0;
+	b->last = now;
+	return true;
+  }
+
+  if (take_token(l, b, now)) return true;
+
+  l->drops++;
+  return false;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool take_token(struct limiter_s *l, struct bucket_s *b, uint64_t now) {
+  // refill at rate per second (1 token per ms is 1 datagram per s)
+  if (now > b->last) {
+	uint64_t tokens = b->tokens + (now - b->last) * l->rate;
+	b->tokens = tokens > l->burst * 1000 ? l->burst * 1000 : tokens;
+	b->last = now;
+  }
+
+  if (b->tokens >= 1000) {
+	b->tokens -= 1000;
+	return true;
+  }
+
+  b->drops++;
+  return false;
+}
+
 
+/*---------------------------------------------------------------------------*/
+static int send_message(mdnssd_handle_t *handle, mDNSQuestion* questions, int count, mDNSResourceRecord* answers, int an_count) {
   mDNSMessage* msg;
   char* data;
   size_t data_size;
   int res;
   struct sockaddr_in addr;
-  socklen_t addrlen;
-  char* query_str;
-
-  if ((query_str = prepare_query_string(query_arg)) == NULL) return -1;
+  struct sockaddr_in6 addr6;
 
+  memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
   addr.sin_port = htons(MDNS_PORT);
   addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
-  addrlen = sizeof(addr);
+
+  memset(&addr6, 0, sizeof(addr6));
+  addr6.sin6_family = AF_INET6;
+  addr6.sin6_port = htons(MDNS_PORT);
+  inet_pton(AF_INET6, MDNS_MULTICAST_ADDRESS6, &addr6.sin6_addr);
 
   // build and pack the query message
-  msg = mdns_build_query_message(query_str, query_type, unicast);
-  free(query_str);
+  msg = mdns_build_query_message(handle, questions, count, answers, an_count);
   if (!msg) return -1;
 
-  data = mdns_pack_message(msg, &data_size);
+  data = mdns_pack_message(handle, msg, &data_size);
   free(msg->data);
   free(msg);
   if (!data) return -1;
 
-  debug("Sending DNS message with length: %u\n", data_size);
+  debug(handle, "Sending DNS message with length: %u\n", data_size);
   // send query message
-  res = sendto(sock, data, data_size, 0, (struct sockaddr *) &addr, addrlen);
+  // query goes on every interface, it's a success if it went out somewhere
+  res = -1;
+  for (int i = 0; i < handle->iface_count; i++) {
+	struct iface_s *iface = handle->ifaces + i;
+	if (iface->down) continue;
+	addr6.sin6_scope_id = iface->index;
+	int sent = iface->v6 ? sendto(iface->sock, data, data_size, 0, (struct sockaddr *) &addr6, sizeof(addr6)) :
+						   sendto(iface->sock, data, data_size, 0, (struct sockaddr *) &addr, sizeof(addr));
+	if (sent > res) res = sent;
+  }
   free(data);
 
+  if (res >= 0) {
+	int i;
+	for (i = 0; i < count && !questions[i].prefer_unicast_response; i++);
+	if (i < count) handle->counters.qu++;
+	else handle->counters.qm++;
+  }
+
+  return res;
+}
+
+
+// questions' names are plain strings, answers (if any) go with the first message
+/*---------------------------------------------------------------------------*/
+static int send_questions(mdnssd_handle_t *handle, mDNSQuestion* questions, int count, mDNSResourceRecord* answers, int an_count) {
+  mDNSQuestion *q = malloc(count * sizeof(mDNSQuestion));
+  int res = 0;
+
+  for (int i = 0; i < count; i++) {
+	q[i] = questions[i];
+	q[i].qname = prepare_query_string(handle, questions[i].qname);
+  }
+
+  // split in as many messages as needed to avoid fragmentation
+  for (int first = 0; first < count;) {
+	size_t size = DNS_HEADER_SIZE;
+	int n = 0;
+
+	while (first + n < count && (!n || size + strlen(q[first + n].qname) + 1 + 4 <= MDNS_PACKET_SIZE)) {
+		size += strlen(q[first + n].qname) + 1 + 4;
+		n++;
+	}
+
+	res = send_message(handle, q + first, n, first ? NULL : answers, first ? 0 : an_count);
+	first += n;
+  }
+
+  for (int i = 0; i < count; i++) NFREE(q[i].qname);
+  free(q);
+
   return res;
 }
 
@@ -810,59 +1298,182 @@ static int send_query(int sock, const char* query_arg, uint16_t query_type, bool
  */
  /*---------------------------------------------------------------------------*/
 static int is_complete(slist_t *s) {
-  if (s->addr.s_addr && s->hostname && s->port && s->txt) return 1;
+  if ((s->addr_count || s->addr6_count) && s->hostname && s->port && s->txt) return 1;
   else return 0;
 }
 
 /*---------------------------------------------------------------------------*/
-static void store_a(struct context_s *context, mDNSResourceRecord* rr) {
+static void store_a(mdnssd_handle_t *handle, mDNSResourceRecord* rr) {
+  struct context_s *context = &handle->context;
   alist_t *b;
   struct in_addr addr;
+  uint32_t now = gettime();
+  int i;
 
-  mdns_parse_rr_a(rr->rdata, &addr);
+  mdns_parse_rr_a(handle, rr->rdata, &addr);
+  if (!addr.s_addr) return;
 
-  for (b = context->alist; b; b = b->next) {
+  b = find_a(context, rr->name, handle->loop.iface);
 
-	if (!strcmp(b->name, rr->name)) {
-		if (addr.s_addr) b->addr = addr;
-		b->rr.ttl = rr->ttl;
-		b->rr.last = gettime();
-		return;
-	}
+  if (!b) {
+	// goodbye for something we don't know
+	if (!rr->ttl) return;
+	b = calloc(1, sizeof(alist_t));
+	b->name = strdup(rr->name);
+	b->iface = handle->loop.iface;
+	insert_item((item_t*) b, (item_t**) &context->alist);
+  }
+
+  // keep addresses sorted so that services see a stable set
+  for (i = 0; i < b->count && ntohl(b->addrs[i].addr.s_addr) < ntohl(addr.s_addr); i++);
+
+  if (i == b->count || b->addrs[i].addr.s_addr != addr.s_addr) {
+	if (!rr->ttl) return;
+	b->addrs = realloc(b->addrs, (b->count + 1) * sizeof(struct a_addr_s));
+	memmove(b->addrs + i + 1, b->addrs + i, (b->count - i) * sizeof(struct a_addr_s));
+	b->addrs[i].addr = addr;
+	b->count++;
+  } else if (!rr->ttl) {
+	context->goodbye = true;
+  }
+
+  b->addrs[i].rr.ttl = rr->ttl;
+  b->addrs[i].rr.last = now;
+  b->addrs[i].rr.wake = 0;
+  b->addrs[i].rr.fp = rr->fp;
+  if (rr->ttl) remember_fp(context, rr->fp, b, DNS_RR_TYPE_A, &addr);
+
+  if (rr->cache_flush) flush_a(b, false, i, now);
+  account_a(context, b);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void store_aaaa(mdnssd_handle_t *handle, mDNSResourceRecord* rr) {
+  struct context_s *context = &handle->context;
+  alist_t *b;
+  struct in6_addr addr;
+  uint32_t now = gettime();
+  int i;
+
+  mdns_parse_rr_aaaa(handle, rr->rdata, rr->rdata_length, &addr);
+  if (IN6_IS_ADDR_UNSPECIFIED(&addr)) return;
+
+  b = find_a(context, rr->name, handle->loop.iface);
+
+  if (!b) {
+	if (!rr->ttl) return;
+	b = calloc(1, sizeof(alist_t));
+	b->name = strdup(rr->name);
+	b->iface = handle->loop.iface;
+	insert_item((item_t*) b, (item_t**) &context->alist);
+  }
+
+  for (i = 0; i < b->count6 && memcmp(&b->addrs6[i].addr, &addr, sizeof(addr)) < 0; i++);
+
+  if (i == b->count6 || memcmp(&b->addrs6[i].addr, &addr, sizeof(addr))) {
+	if (!rr->ttl) return;
+	b->addrs6 = realloc(b->addrs6, (b->count6 + 1) * sizeof(struct aaaa_addr_s));
+	memmove(b->addrs6 + i + 1, b->addrs6 + i, (b->count6 - i) * sizeof(struct aaaa_addr_s));
+	b->addrs6[i].addr = addr;
+	b->count6++;
+  } else if (!rr->ttl) {
+	context->goodbye = true;
   }
 
-  b = malloc(sizeof(alist_t));
-  b->addr = addr;
-  b->name = strdup(rr->name);
-  b->rr.ttl = rr->ttl;
-  b->rr.last = gettime();
-    
-  insert_item((item_t*) b, (item_t**) &context->alist);
+  b->addrs6[i].rr.ttl = rr->ttl;
+  b->addrs6[i].rr.last = now;
+  b->addrs6[i].rr.wake = 0;
+  b->addrs6[i].rr.fp = rr->fp;
+  if (rr->ttl) remember_fp(context, rr->fp, b, DNS_RR_TYPE_AAAA, &addr);
+
+  if (rr->cache_flush) flush_a(b, true, i, now);
+  account_a(context, b);
+}
+
+
+// other addresses not confirmed during last second are obsolete (RFC6762 10.2)
+/*---------------------------------------------------------------------------*/
+static void flush_a(alist_t *a, bool v6, int keep, uint32_t now) {
+  for (int i = 0; i < (v6 ? a->count6 : a->count); i++) {
+	struct ttl_timing_s *t = v6 ? &a->addrs6[i].rr : &a->addrs[i].rr;
+	if (i == keep || now - t->last < 1 || t->last + t->ttl <= now + 1) continue;
+	t->ttl = now + 1 - t->last;
+	t->wake = UINT32_MAX;
+  }
 }
 
 
 /*---------------------------------------------------------------------------*/
-static slist_t *create_s(struct in_addr host, char *name, slist_t **list) {
+static slist_t *create_s(mdnssd_handle_t *handle, struct in6_addr host, char *name) {
   slist_t *s = calloc(1, sizeof(slist_t));
   s->name = strdup(name);
   s->host = host;
-  insert_item((item_t*) s, (item_t**) list);
+  s->iface = handle->loop.iface;
+  s->local = handle->ifaces[s->iface].host;
+  s->scope6 = handle->ifaces[s->iface].index;
+  // not reported until complete
+  s->shadow = true;
+  // give other records a chance to arrive before asking for them
+  s->resolve.next = gettime_ms() + RESOLVE_DELAY;
+  insert_item((item_t*) s, (item_t**) &handle->context.slist);
   return s;
 }
 
 
+/*
+  A unique record with cache-flush set means that the sender now owns it, so
+  the same instance cached from other hosts and not confirmed during the last
+  second is set to expire in one second (RFC6762 10.2). As services are cached
+  per host, the whole entry goes, not only the record that has been flushed
+ */
+/*---------------------------------------------------------------------------*/
+static void flush_s(struct context_s *context, slist_t *owner, uint32_t now) {
+  for (slist_t *s = context->slist; s; s = s->next) {
+	struct ttl_timing_s *rr[] = { &s->rr_ptr, &s->rr_srv, &s->rr_txt };
+
+	// other interfaces are other links, there is nothing to flush there
+	if (s == owner || s->iface != owner->iface || strcmp(s->name, owner->name)) continue;
+
+	for (int i = 0; i < 3; i++) {
+		if (!rr[i]->last || now - rr[i]->last < 1 || rr[i]->last + rr[i]->ttl <= now + 1) continue;
+		rr[i]->ttl = now + 1 - rr[i]->last;
+		// no refresh for what is about to go
+		rr[i]->wake = UINT32_MAX;
+	}
+  }
+}
+
+
 /*---------------------------------------------------------------------------*/
-static void store_other(struct in_addr host, struct context_s *context, char *message, mDNSResourceRecord* rr) {
+static void store_other(mdnssd_handle_t *handle, struct in6_addr host, char *message, mDNSResourceRecord* rr) {
+  struct context_s *context = &handle->context;
   slist_t *b = NULL;
   char *name = NULL;
+  int iface = handle->loop.iface;
   uint32_t now;
+  bool direct = false, subtype;
+  const char *type;
+
+  // service types and instances to count are not services
+  if (rr->type == DNS_RR_TYPE_PTR && context->enumerate.on && store_type(handle, message, rr)) return;
+
+  // not for us unless it belongs to a browsed type or is directly resolved
+  type = match_type(context, rr->name, rr->type == DNS_RR_TYPE_PTR);
+  if (!type) {
+	direct = rr->type != DNS_RR_TYPE_PTR && find_lookup(handle, rr->name, false);
+	if (!direct) {
+		remember_fp(context, rr->fp, NULL, rr->type, NULL);
+		return;
+	}
+  }
 
-  // for a PTR, the rr name must match exactly the query, for others it shall
-  // at least contain it, otherwise it's not for us
-  if ((rr->type == DNS_RR_TYPE_PTR && strcmp(rr->name, context->query)) ||
-	  !strstr(rr->name, context->query)) return;
+  // only the subtype's PTR says that an instance of the parent type is one of
+  // its instances, other records can't create it
+  subtype = type && rr->type != DNS_RR_TYPE_PTR && parent_type(type) != type;
 
   now = gettime();
+  if (!rr->ttl) context->goodbye = true;
   
   // the queuing tool is head insertion, so this reverts the time or arrival
   // entry with ttl = 0 are not created, deletion must apply to an existing one
@@ -870,15 +1481,18 @@ static void store_other(struct in_addr host, struct context_s *context, char *me
 
 	// PTR: get service name
 	case DNS_RR_TYPE_PTR: {
-	  mdns_parse_rr_ptr(message, rr->rdata, &name);
+	  mdns_parse_rr_ptr(handle, message, rr->rdata, &name);
 
 	  // can't factorize the "for/switch" as name is updated above
-	  for (b = context->slist; b && (strcmp(b->name, name) || b->host.s_addr != host.s_addr); b = b->next)
-	  if (!b && rr->ttl) b = create_s(host, name, &context->slist);
+	  for (b = context->slist; b && (strcmp(b->name, name) || memcmp(&b->host, &host, sizeof(host)) || b->iface != iface); b = b->next);
+	  if (!b && rr->ttl) b = create_s(handle, host, name);
 
 	  if (b) {
 		  b->rr_ptr.last = now;
 		  b->rr_ptr.ttl = rr->ttl;
+		  b->rr_ptr.wake = 0;
+		  b->rr_ptr.fp = rr->fp;
+		  if (rr->ttl) remember_fp(context, rr->fp, b, DNS_RR_TYPE_PTR, NULL);
 	  }
 
 	  free(name);
@@ -888,12 +1502,16 @@ static void store_other(struct in_addr host, struct context_s *context, char *me
 	// SRV: service descriptor ==> get hostname & port
 	case DNS_RR_TYPE_SRV: {
 	  unsigned short port;
+	  uint16_t priority, weight;
 	  char *hostname = NULL;
 
-	  mdns_parse_rr_srv(message, rr->rdata, &hostname, &port);
+	  mdns_parse_rr_srv(handle, message, rr->rdata, &hostname, &port, &priority, &weight);
 
-	  for (b = context->slist; b && (strcmp(b->name, rr->name) || b->host.s_addr != host.s_addr); b = b->next);
-	  if (!b && rr->ttl) b = create_s(host, rr->name, &context->slist);
+	  for (b = context->slist; b && (strcmp(b->name, rr->name) || memcmp(&b->host, &host, sizeof(host)) || b->iface != iface); b = b->next);
+	  if (!b && rr->ttl && !subtype) {
+		  b = create_s(handle, host, rr->name);
+		  b->direct = direct;
+	  }
 
 	  if (b) {
 		// update port
@@ -901,6 +1519,12 @@ static void store_other(struct in_addr host, struct context_s *context, char *me
 		  b->port = port;
 		  b->status = MDNS_UPDATED;
 		}
+		// update selection order
+		if (b->priority != priority || b->weight != weight) {
+		  b->priority = priority;
+		  b->weight = weight;
+		  b->status = MDNS_UPDATED;
+		}
 		// update hostname
 		if (!b->hostname || strcmp(b->hostname, hostname)) {
 		  NFREE(b->hostname);
@@ -909,6 +1533,10 @@ static void store_other(struct in_addr host, struct context_s *context, char *me
 		}
 		b->rr_srv.last = now;
 		b->rr_srv.ttl = rr->ttl;
+		b->rr_srv.wake = 0;
+		b->rr_srv.fp = rr->fp;
+		if (rr->ttl) remember_fp(context, rr->fp, b, DNS_RR_TYPE_SRV, NULL);
+		if (rr->cache_flush) flush_s(context, b, now);
 	  }
 
 	  free(hostname);
@@ -922,8 +1550,11 @@ static void store_other(struct in_addr host, struct context_s *context, char *me
 
 	  mdns_parse_rr_txt(message, rr, &txt, &length);
 
-	  for (b = context->slist; b && (strcmp(b->name, rr->name) || b->host.s_addr != host.s_addr); b = b->next);
-	  if (!b && rr->ttl) b = create_s(host, rr->name, &context->slist);
+	  for (b = context->slist; b && (strcmp(b->name, rr->name) || memcmp(&b->host, &host, sizeof(host)) || b->iface != iface); b = b->next);
+	  if (!b && rr->ttl && !subtype) {
+		  b = create_s(handle, host, rr->name);
+		  b->direct = direct;
+	  }
 
 	  if (b) {
 		// update txt
@@ -936,546 +1567,3461 @@ static void store_other(struct in_addr host, struct context_s *context, char *me
 		}
 		b->rr_txt.last = now;
 		b->rr_txt.ttl = rr->ttl;
+		b->rr_txt.wake = 0;
+		b->rr_txt.fp = rr->fp;
+		if (rr->ttl) remember_fp(context, rr->fp, b, DNS_RR_TYPE_TXT, NULL);
+		if (rr->cache_flush) flush_s(context, b, now);
 	  }
 
 	  free(txt);
 	  break;
 	}
   }
+
+  if (b) account_s(context, b);
 }
 
 
+// instances of a subtype (_printer._sub._http._tcp.local) belong to the parent type
 /*---------------------------------------------------------------------------*/
-static void update_wake_rr(uint32_t* wake, uint32_t now, struct ttl_timing_s* t) {
-	double retries[] = { 0.5, 0.8, 0.9, 0.95 };
+static const char *parent_type(const char *type) {
+  const char *sub = strstr(type, "._sub.");
+  return sub ? sub + 6 : type;
+}
 
-	// rr not current, don't participate to bid
-	if (!t->last) return;
 
-	// apply RFC6762 retries timeouts
-	for (int i = 0; i < 4; i++) {
-		uint32_t to = t->last + (uint32_t)(t->ttl * retries[i]);
-		if (now <= to) {
-			if (*wake > to) *wake = to;
-			t->wake = to;
-			break;
-		}
-	}
+// 0 when not matching, 1 when only the parent of a subtype does, 2 otherwise
+/*---------------------------------------------------------------------------*/
+static int match_rank(const char *type, const char *name, bool ptr) {
+  const char *parent = parent_type(type);
+
+  if (ptr) return strcmp(name, type) ? 0 : 2;
+  if (!strstr(name, parent)) return 0;
+  return parent == type ? 2 : 1;
 }
 
 
+// for a PTR, the rr name must match exactly a browsed type, for others it shall
+// at least contain it (or its parent for a subtype, when nothing better matches)
 /*---------------------------------------------------------------------------*/
-static void update_wake(struct context_s* context, uint32_t *wake, uint32_t now) {
-	for (slist_t* s = context->slist; s; s = s->next) {
-		if (s && s->status != MDNS_CURRENT) continue;
-		update_wake_rr(wake, now, &s->rr_ptr);
-		update_wake_rr(wake, now, &s->rr_srv);
-		update_wake_rr(wake, now, &s->rr_txt);
-	}
+static const char *match_type(struct context_s *context, const char *name, bool ptr) {
+  const char *match = NULL;
+  int best = 0, rank;
 
-	/*
-	for (alist_t* a = context->alist; a; a = a->next) {
-		update_wake_rr(wake, now, &a->rr);
+  if (context->query && (rank = match_rank(context->query, name, ptr)) > best) {
+	best = rank;
+	match = context->query;
+  }
+
+  for (browse_t *b = context->browses; b && best < 2; b = b->next) {
+	if ((rank = match_rank(b->name, name, ptr)) > best) {
+		best = rank;
+		match = b->name;
 	}
-	*/
+  }
+
+  return match;
 }
 
 
+// returns true when the record answers the meta-query, instances are only counted
 /*---------------------------------------------------------------------------*/
-static bool check_query(struct context_s* context, uint32_t now) {
-	// if there is nothign in the service list, we must launcha  query
-	if (!context->slist || !context->alist) return true;
+static bool store_type(mdnssd_handle_t *handle, char *message, mDNSResourceRecord *rr) {
+  struct context_s *context = &handle->context;
+  bool meta = !strcmp(rr->name, MDNS_META_QUERY);
+  char *name = NULL;
+  tlist_t *t;
 
-	// check to see if some services have reached their query time
-	for (slist_t* s = context->slist; s; s = s->next) {
-		if (s && s->status != MDNS_CURRENT) continue;
-		if (now >= s->rr_ptr.wake || now >= s->rr_srv.wake || now >= s->rr_txt.wake) return true;
-	}
+  if (!meta && !context->enumerate.count) return false;
+
+  // instance of a known type, each name is counted once
+  if (!meta) {
+	uint64_t hash;
+	int i;
+
+	for (t = context->enumerate.types; t && strcmp(t->name, rr->name); t = t->next);
+	if (!t || !rr->ttl) return false;
 
-	/*
-	for (alist_t* a = context->alist; a; a = a->next) {
-		if (now >= a->rr.wake) return true;
+	mdns_parse_rr_ptr(handle, message, rr->rdata, &name);
+	if (!name) return false;
+
+	hash = hash_bytes(FNV_OFFSET, name, strlen(name));
+	for (i = 0; i < t->count && t->instances[i] != hash; i++);
+	if (i == t->count) {
+		t->instances = realloc(t->instances, (t->count + 1) * sizeof(uint64_t));
+		t->instances[t->count++] = hash;
 	}
-	*/
 
-	// that was jus a wake-up
+	free(name);
 	return false;
-}
+  }
 
+  mdns_parse_rr_ptr(handle, message, rr->rdata, &name);
+  if (!name) return true;
 
-/*---------------------------------------------------------------------------*/
-static mdnssd_service_t *update_cache(struct context_s *context, bool build) {
-  mdnssd_service_t *services = NULL;
-  uint32_t now = gettime();
-  alist_t *a;
-  slist_t* s = context->slist;
-  context->srecords = 0;
-    
-  // order of the slist is reverse time of arrival so the order of the services,
-  // as it uses the same queueing tool, will revert that back ... or so I think
-  while (s) {
-	slist_t *next = s->next;
-	context->srecords++;
-	
-	// got an answer, search for A first
-	a = NULL;
-	if (s->hostname && s->port && s->txt) {
-		for (alist_t *it = context->alist; it; it = it->next) {
-			if (strcmp(s->hostname, it->name)) continue;
-			if (s->addr.s_addr != it->addr.s_addr) {
-				s->addr.s_addr = it->addr.s_addr;
-				s->status = MDNS_UPDATED;
-			}
-			a = it;
-			break;
-		}
+  for (t = context->enumerate.types; t && strcmp(t->name, name); t = t->next);
+
+  if (!t && rr->ttl) {
+	t = calloc(1, sizeof(tlist_t));
+	t->name = strdup(name);
+	insert_item((item_t*) t, (item_t**) &context->enumerate.types);
+
+	// wanted types are browsed right away
+	for (char **wanted = context->enumerate.wanted; wanted && *wanted; wanted++) {
+		if (!strcmp(*wanted, name)) add_browse(handle, name);
 	}
 
-	bool ptr_expired = (s->rr_ptr.last && now >= s->rr_ptr.last + s->rr_ptr.ttl);
-	bool srv_expired = (s->rr_srv.last && now >= s->rr_srv.last + s->rr_srv.ttl);
-	bool txt_expired = (s->rr_txt.last && now >= s->rr_txt.last + s->rr_txt.ttl);
-	
-	// a service has expired - must be done before the below check to make sure
-	// that the expiry is after in the queue
-	if (a && (ptr_expired || srv_expired || txt_expired)) {
-		s->status = MDNS_EXPIRED;
-		if (build) {
-			// set IP & port to zero so that caller knows, but txt is needed
-			mdnssd_service_t *p = calloc(1, sizeof(mdnssd_service_t));
-			p->host = s->host;
-			p->name = strdup(s->name);
-			p->hostname = strdup(s->hostname);
-			p->addr = s->addr;
-			p->port = s->port;
-			if (s->rr_ptr.ttl) {
-				if (s->rr_ptr.last) p->since = now - s->rr_ptr.last;
-				if (s->rr_srv.last && now - s->rr_srv.last > p->since) p->since = now - s->rr_srv.last;
-				if (s->rr_txt.last && now - s->rr_txt.last > p->since) p->since = now - s->rr_txt.last;
-			} else {
-				p->since = 0;
-			}
-			p->expired = true;
-			mdns_parse_txt(s->txt, s->txt_length, p);
-			insert_item((item_t*) p, (item_t**) &services);
+	// give a chance to other types to share the packet, and make sure that
+	// instances already seen (fast path) are parsed again to be counted
+	if (context->enumerate.count) {
+		uint64_t next = gettime_ms() + RESOLVE_DELAY;
+		for (int i = 0; i < FP_SLOTS; i++) {
+			if (context->fingerprints[i].type == DNS_RR_TYPE_PTR) context->fingerprints[i].hash = 0;
 		}
+		if (!handle->loop.resolve || handle->loop.resolve > next) handle->loop.resolve = next;
+	}
+  }
+
+  if (t) {
+	t->rr.last = gettime();
+	t->rr.ttl = rr->ttl;
+	t->rr.wake = 0;
+  }
+
+  free(name);
+  return true;
+}
+
+
+// records ignored so far might now be wanted
+/*---------------------------------------------------------------------------*/
+static void forget_ignored(struct context_s *context) {
+  for (int i = 0; i < FP_SLOTS; i++) {
+	if (!context->fingerprints[i].owner) context->fingerprints[i].hash = 0;
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool add_browse(mdnssd_handle_t *handle, const char *type) {
+  struct context_s *context = &handle->context;
+  uint64_t next = gettime_ms() + RESOLVE_DELAY;
+  browse_t *b;
+
+  for (b = context->browses; b && strcmp(b->name, type); b = b->next);
+  if (b || (context->query && !strcmp(context->query, type))) return false;
+
+  b = calloc(1, sizeof(browse_t));
+  b->name = strdup(type);
+  insert_item((item_t*) b, (item_t**) &context->browses);
+  forget_ignored(context);
+
+  // first browse is packed with other new ones
+  if (!handle->loop.resolve || handle->loop.resolve > next) handle->loop.resolve = next;
+
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_subscribe(struct mdnssd_handle_s *handle, const char *type) {
+  if (!handle || !type || type[0] != '_' || handle->managed.running) return false;
+  add_browse(handle, type);
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_unsubscribe(struct mdnssd_handle_s *handle, const char *type) {
+  struct context_s *context;
+  uint32_t now = gettime();
+  browse_t *b;
+
+  if (!handle || !type || handle->managed.running) return false;
+  context = &handle->context;
+
+  for (b = context->browses; b && strcmp(b->name, type); b = b->next);
+  if (!b) return false;
+
+  remove_item((item_t*) b, (item_t**) &context->browses);
+  free(b->name);
+  free(b);
+
+  // its services leave as if they had said goodbye
+  for (slist_t *s = context->slist; s; s = s->next) {
+	if (s->direct || match_type(context, s->name, false)) continue;
+	s->rr_ptr.last = s->rr_srv.last = now;
+	s->rr_ptr.ttl = s->rr_srv.ttl = 0;
+	context->goodbye = true;
+  }
+
+  handle->loop.wake = now;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_enumeration(struct mdnssd_handle_s *handle, bool count, const char **subscribe) {
+  struct context_s *context;
+  int n = 0;
+
+  if (!handle || handle->managed.running) return false;
+  context = &handle->context;
+
+  for (char **wanted = context->enumerate.wanted; wanted && *wanted; wanted++) free(*wanted);
+  NFREE(context->enumerate.wanted);
+  context->enumerate.wanted = NULL;
+  context->enumerate.count = count;
+
+  if (!subscribe) return true;
+
+  while (subscribe[n]) n++;
+  context->enumerate.wanted = calloc(n + 1, sizeof(char*));
+  for (int i = 0; i < n; i++) context->enumerate.wanted[i] = strdup(subscribe[i]);
+
+  return true;
+}
+
+
+// types in order of discovery
+/*---------------------------------------------------------------------------*/
+mdnssd_type_t *mdnssd_get_types(struct mdnssd_handle_s *handle) {
+  mdnssd_type_t *types = NULL;
+  uint32_t now = gettime();
+
+  if (!handle) return NULL;
+
+  for (tlist_t *t = handle->context.enumerate.types; t; t = t->next) {
+	mdnssd_type_t *p = calloc(1, sizeof(mdnssd_type_t));
+	p->name = strdup(t->name);
+	p->instances = t->count;
+	p->since = now - t->rr.last;
+	insert_item((item_t*) p, (item_t**) &types);
+  }
+
+  return types;
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_free_types(mdnssd_type_t *types) {
+  while (types) {
+	mdnssd_type_t *next = types->next;
+	free(types->name);
+	free(types);
+	types = next;
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+static lookup_t *find_lookup(mdnssd_handle_t *handle, const char *name, bool host) {
+  for (lookup_t *l = handle->lookups; l; l = l->next) {
+	if (l->host == host && !strcmp(l->name, name)) return l;
+  }
+  return NULL;
+}
+
+
+// what the cache knows and has not expired, from any interface
+/*---------------------------------------------------------------------------*/
+static mdnssd_service_t *resolve_cached(struct context_s *context, const char *name, bool host, uint32_t now) {
+  if (!host) {
+	for (slist_t *s = context->slist; s; s = s->next) {
+		if (strcmp(s->name, name) || s->tomb || !is_complete(s)) continue;
+		if (now >= s->rr_srv.last + s->rr_srv.ttl || now >= s->rr_txt.last + s->rr_txt.ttl) continue;
+		return build_service(s, now, false);
+	}
+	return NULL;
+  }
+
+  for (alist_t *a = context->alist; a; a = a->next) {
+	mdnssd_service_t *p;
+	int i;
+
+	if (strcmp(a->name, name)) continue;
+	for (i = 0; i < a->count && now >= a->addrs[i].rr.last + a->addrs[i].rr.ttl; i++);
+	if (i == a->count) {
+		for (i = 0; i < a->count6 && now >= a->addrs6[i].rr.last + a->addrs6[i].rr.ttl; i++);
+		if (i == a->count6) continue;
+	}
+
+	// a host is a service with only name and addresses
+	p = calloc(1, sizeof(mdnssd_service_t));
+	p->name = strdup(a->name);
+	p->hostname = strdup(a->name);
+	p->addrs = malloc(a->count * sizeof(struct in_addr));
+	for (i = 0; i < a->count; i++) {
+		if (now < a->addrs[i].rr.last + a->addrs[i].rr.ttl) p->addrs[p->addr_count++] = a->addrs[i].addr;
+	}
+	if (p->addr_count) p->addr = p->addrs[0];
+	p->addrs6 = malloc(a->count6 * sizeof(struct in6_addr));
+	for (i = 0; i < a->count6; i++) {
+		if (now < a->addrs6[i].rr.last + a->addrs6[i].rr.ttl) p->addrs6[p->addr6_count++] = a->addrs6[i].addr;
+	}
+	return p;
+  }
+
+  return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool add_lookup(mdnssd_handle_t *handle, const char *name, bool host, int timeout, mdnssd_resolve_cb_t *callback, void *cookie) {
+  mdnssd_service_t *service;
+  lookup_t *l;
+
+  if (!handle || !name || !callback || handle->managed.running) return false;
+
+  // fresh enough in cache, no need to ask
+  service = resolve_cached(&handle->context, name, host, gettime());
+  if (service) {
+	if (!callback(name, service, cookie)) mdnssd_free_list(service);
+	return true;
+  }
+
+  l = calloc(1, sizeof(lookup_t));
+  l->name = strdup(name);
+  l->host = host;
+  l->deadline = gettime_ms() + timeout;
+  l->callback = callback;
+  l->cookie = cookie;
+  insert_item((item_t*) l, (item_t**) &handle->lookups);
+
+  // records ignored so far might now be wanted
+  forget_ignored(&handle->context);
+
+  // give a chance to other resolutions to share the packet
+  l->next_ask = gettime_ms() + RESOLVE_DELAY;
+  if (!handle->loop.resolve || handle->loop.resolve > l->next_ask) handle->loop.resolve = l->next_ask;
+
+  return true;
+}
+
+
+// answered or timed-out resolutions leave the list before their callback
+/*---------------------------------------------------------------------------*/
+static void check_lookups(mdnssd_handle_t *handle) {
+  uint64_t now = gettime_ms();
+  lookup_t *l = handle->lookups;
+
+  while (l) {
+	lookup_t *next = l->next;
+	mdnssd_service_t *service = resolve_cached(&handle->context, l->name, l->host, gettime());
+
+	if (service || now >= l->deadline) {
+		remove_item((item_t*) l, (item_t**) &handle->lookups);
+		if (!l->callback(l->name, service, l->cookie) && service) mdnssd_free_list(service);
+		free(l->name);
+		free(l);
+	}
+
+	l = next;
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_resolve_instance(struct mdnssd_handle_s *handle, const char *instance, int timeout, mdnssd_resolve_cb_t *callback, void *cookie) {
+  return add_lookup(handle, instance, false, timeout, callback, cookie);
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_resolve_host(struct mdnssd_handle_s *handle, const char *hostname, int timeout, mdnssd_resolve_cb_t *callback, void *cookie) {
+  return add_lookup(handle, hostname, true, timeout, callback, cookie);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void resolve_incomplete(mdnssd_handle_t *handle) {
+  bool qu = ask_unicast(handle);
+  mDNSQuestion questions[RESOLVE_MAX];
+  int count = 0;
+  uint64_t now = gettime_ms();
+
+  handle->loop.resolve = 0;
+
+  // ask only what is missing to get a complete service
+  for (slist_t *s = handle->context.slist; s; s = s->next) {
+	bool srv = !s->hostname, txt = !s->txt, a = false;
+	int missing, fresh, ask = 0;
+
+	// don't chase services that are leaving
+	if (s->status == MDNS_EXPIRED || (s->rr_ptr.last && !s->rr_ptr.ttl)) continue;
+
+	if (s->hostname) {
+		alist_t *it = find_a(&handle->context, s->hostname, s->iface);
+		a = !it || (!it->count && !it->count6);
+	}
+
+	missing = srv | (txt << 1) | (a << 2);
+
+	if (!missing) {
+		s->resolve.tries = s->resolve.asked = 0;
+		continue;
+	}
+
+	// something new is missing (A once SRV is known) so ask for it right away,
+	// otherwise ask for everything with exponential backoff
+	fresh = s->resolve.asked ? missing & ~s->resolve.asked : 0;
+	if (fresh) ask = fresh;
+	else if (s->resolve.tries < RESOLVE_TRIES && now >= s->resolve.next) ask = missing;
+
+	if (ask && count + ((ask & 1) + ((ask >> 1) & 1) + ((ask >> 2) & 1) * 2) <= RESOLVE_MAX) {
+		if (ask & 0x01) questions[count++] = (mDNSQuestion) { s->name, DNS_RR_TYPE_SRV, 1, qu };
+		if (ask & 0x02) questions[count++] = (mDNSQuestion) { s->name, DNS_RR_TYPE_TXT, 1, qu };
+		if (ask & 0x04) {
+			int i;
+			// hosts can have multiple services
+			for (i = 0; i < count && (questions[i].qtype != DNS_RR_TYPE_A || strcmp(questions[i].qname, s->hostname)); i++);
+			if (i == count) {
+				questions[count++] = (mDNSQuestion) { s->hostname, DNS_RR_TYPE_A, 1, qu };
+				if (handle->ipv6) questions[count++] = (mDNSQuestion) { s->hostname, DNS_RR_TYPE_AAAA, 1, qu };
+			}
+		}
+		s->resolve.asked |= ask;
+		if (!fresh) s->resolve.next = now + (1000 << s->resolve.tries++);
+	} else if (fresh) {
+		// ran out of room, come back immediately
+		s->resolve.next = now;
+	}
+
+	// earliest next resolution
+	if (s->resolve.tries >= RESOLVE_TRIES && !fresh) continue;
+	if (!handle->loop.resolve || handle->loop.resolve > s->resolve.next) handle->loop.resolve = s->resolve.next;
+  }
+
+  // direct resolutions share the same packets, with the same backoff
+  for (lookup_t *l = handle->lookups; l; l = l->next) {
+	if (now >= l->next_ask && count + 2 <= RESOLVE_MAX) {
+		if (l->host) {
+			questions[count++] = (mDNSQuestion) { l->name, DNS_RR_TYPE_A, 1, qu };
+			if (handle->ipv6) questions[count++] = (mDNSQuestion) { l->name, DNS_RR_TYPE_AAAA, 1, qu };
+		} else {
+			questions[count++] = (mDNSQuestion) { l->name, DNS_RR_TYPE_SRV, 1, qu };
+			questions[count++] = (mDNSQuestion) { l->name, DNS_RR_TYPE_TXT, 1, qu };
+		}
+		l->next_ask = now + (1000 << (l->tries < RESOLVE_TRIES ? l->tries++ : l->tries));
+	}
+	if (!handle->loop.resolve || handle->loop.resolve > l->next_ask) handle->loop.resolve = l->next_ask;
+	if (handle->loop.resolve > l->deadline) handle->loop.resolve = l->deadline;
+  }
+
+  // first browse of new types and counting of enumerated ones, what does not
+  // fit is for the next pass
+  for (browse_t *b = handle->context.browses; b; b = b->next) {
+	if (b->asked) continue;
+	if (count == RESOLVE_MAX) {
+		handle->loop.resolve = now;
+		break;
+	}
+	questions[count++] = (mDNSQuestion) { b->name, DNS_RR_TYPE_PTR, 1, qu };
+	b->asked = true;
+  }
+
+  for (tlist_t *t = handle->context.enumerate.types; t && handle->context.enumerate.count; t = t->next) {
+	int i;
+	if (t->asked) continue;
+	if (count == RESOLVE_MAX) {
+		handle->loop.resolve = now;
+		break;
+	}
+	// might just have been subscribed to
+	for (i = 0; i < count && (questions[i].qtype != DNS_RR_TYPE_PTR || strcmp(questions[i].qname, t->name)); i++);
+	if (i == count) questions[count++] = (mDNSQuestion) { t->name, DNS_RR_TYPE_PTR, 1, qu };
+	t->asked = true;
+  }
+
+  if (count) {
+	debug(handle, "resolving %d missing records\n", count);
+	send_questions(handle, questions, count, NULL, 0);
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void update_wake_rr(uint32_t* wake, uint32_t now, struct ttl_timing_s* t) {
+	double retries[] = { 0.5, 0.8, 0.9, 0.95 };
+
+	// rr not current, don't participate to bid
+	if (!t->last) return;
+
+	// an armed refresh point stays until due_rr serves it, even when late (then
+	// at next pass), it is only re-armed when served or when rr is received
+	if (t->wake && t->wake != UINT32_MAX) {
+		uint32_t at = t->wake > now ? t->wake : now + 1;
+		if (*wake > at) *wake = at;
+		return;
+	}
+
+	// apply RFC6762 retries timeouts, next point is strictly after now so that
+	// the one being served is not armed again
+	for (int i = 0; !t->wake && i < 4; i++) {
+		uint32_t to = t->last + (uint32_t)(t->ttl * retries[i]);
+		if (now < to) {
+			if (*wake > to) *wake = to;
+			t->wake = to;
+			return;
+		}
+	}
+
+	// no more retries, just wait for expiry
+	t->wake = UINT32_MAX;
+	if (*wake > t->last + t->ttl) *wake = t->last + t->ttl;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static alist_t *find_a(struct context_s* context, char *name, int iface) {
+	alist_t *a;
+	for (a = context->alist; a && (a->iface != iface || strcmp(a->name, name)); a = a->next);
+	return a;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void update_wake(struct context_s* context, uint32_t *wake, uint32_t now) {
+	for (tlist_t *t = context->enumerate.types; t; t = t->next) update_wake_rr(wake, now, &t->rr);
+	for (slist_t* s = context->slist; s; s = s->next) {
+		alist_t *a;
+		if (s->tomb) {
+			if (*wake > s->tomb) *wake = s->tomb;
+			continue;
+		}
+		if (s->status != MDNS_CURRENT) continue;
+		update_wake_rr(wake, now, &s->rr_ptr);
+		update_wake_rr(wake, now, &s->rr_srv);
+		update_wake_rr(wake, now, &s->rr_txt);
+		// only A used by services are refreshed
+		if (s->hostname && (a = find_a(context, s->hostname, s->iface)) != NULL) {
+			for (int i = 0; i < a->count; i++) update_wake_rr(wake, now, &a->addrs[i].rr);
+			for (int i = 0; i < a->count6; i++) update_wake_rr(wake, now, &a->addrs6[i].rr);
+		}
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool due_rr(struct ttl_timing_s* t, uint32_t now) {
+	uint32_t dummy = UINT32_MAX;
+
+	// group all refresh points that fall in the same window
+	if (!t->last || !t->wake || t->wake == UINT32_MAX || t->wake > now + REFRESH_WINDOW) return false;
+
+	// move to the refresh point after the one served
+	now = t->wake;
+	t->wake = 0;
+	update_wake_rr(&dummy, now, t);
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool refresh_cache(mdnssd_handle_t *handle, uint32_t now) {
+	struct context_s* context = &handle->context;
+	bool qu = ask_unicast(handle);
+	mDNSQuestion questions[REFRESH_MAX], *browses = NULL;
+	mDNSResourceRecord *known = NULL;
+	int count = 0, known_count = 0, browse_count = 0;
+	bool browse = (context->query || context->browses || context->enumerate.on) &&
+				  (!context->slist || !context->alist || handle->loop.qu);
+	size_t size = DNS_HEADER_SIZE;
+
+	// only ask what is about to expire
+	for (slist_t* s = context->slist; s && count + 4 <= REFRESH_MAX; s = s->next) {
+		alist_t *a;
+
+		if (s->status != MDNS_CURRENT) continue;
+
+		if (due_rr(&s->rr_ptr, now) && !s->direct) browse = true;
+		if (due_rr(&s->rr_srv, now)) questions[count++] = (mDNSQuestion) { s->name, DNS_RR_TYPE_SRV, 1, qu };
+		if (due_rr(&s->rr_txt, now)) questions[count++] = (mDNSQuestion) { s->name, DNS_RR_TYPE_TXT, 1, qu };
+		if (s->hostname && (a = find_a(context, s->hostname, s->iface)) != NULL) {
+			bool due = false, due6 = false;
+			// one question refreshes all addresses of the host
+			for (int i = 0; i < a->count; i++) due |= due_rr(&a->addrs[i].rr, now);
+			for (int i = 0; i < a->count6; i++) due6 |= due_rr(&a->addrs6[i].rr, now);
+			if (due) questions[count++] = (mDNSQuestion) { a->name, DNS_RR_TYPE_A, 1, qu };
+			if (due6) questions[count++] = (mDNSQuestion) { a->name, DNS_RR_TYPE_AAAA, 1, qu };
+		}
+	}
+
+	// service types are refreshed by the meta-query
+	for (tlist_t *t = context->enumerate.types; t; t = t->next) {
+		if (due_rr(&t->rr, now)) browse = true;
+	}
+
+	// all browsed types go together, known answers apply to all of them
+	if (browse) {
+		for (browse_t *b = context->browses; b; b = b->next) browse_count++;
+		browses = malloc((browse_count + 2) * sizeof(mDNSQuestion));
+		browse_count = 0;
+
+		if (context->query) browses[browse_count++] = (mDNSQuestion) { (char*) context->query, DNS_RR_TYPE_PTR, 1, qu };
+		for (browse_t *b = context->browses; b; b = b->next) {
+			browses[browse_count++] = (mDNSQuestion) { b->name, DNS_RR_TYPE_PTR, 1, qu };
+			b->asked = true;
+		}
+		if (context->enumerate.on) browses[browse_count++] = (mDNSQuestion) { MDNS_META_QUERY, DNS_RR_TYPE_PTR, 1, qu };
+
+		for (int i = 0; i < browse_count; i++) size += strlen(browses[i].qname) + 2 + 4;
+	}
+
+	// PTR browse carries as known answers the PTR that still have more than half
+	// their ttl so that only the responders of expiring ones answer (RFC6762 7.1)
+	if (browse) {
+		for (slist_t* s = context->slist; s; s = s->next) known_count++;
+		for (tlist_t *t = context->enumerate.types; t; t = t->next) known_count++;
+		known = malloc(known_count * sizeof(mDNSResourceRecord));
+		known_count = 0;
+		for (slist_t* s = context->slist; s; s = s->next) {
+			const char *type;
+			if (s->status != MDNS_CURRENT || !s->rr_ptr.last || now - s->rr_ptr.last >= s->rr_ptr.ttl / 2) continue;
+			if ((type = match_type(context, s->name, false)) == NULL) continue;
+			// don't build fragmented queries, missing known answers just cause more answers
+			size += strlen(type) + 2 + 10 + strlen(s->name) + 2;
+			if (size > MDNS_PACKET_SIZE) break;
+			known[known_count++] = (mDNSResourceRecord) { (char*) type, DNS_RR_TYPE_PTR, 1,
+														   s->rr_ptr.last + s->rr_ptr.ttl - now, 0, s->name };
+		}
+		for (tlist_t *t = context->enumerate.types; t && size <= MDNS_PACKET_SIZE; t = t->next) {
+			if (!t->rr.last || now - t->rr.last >= t->rr.ttl / 2) continue;
+			size += strlen(MDNS_META_QUERY) + 2 + 10 + strlen(t->name) + 2;
+			if (size > MDNS_PACKET_SIZE) break;
+			known[known_count++] = (mDNSResourceRecord) { MDNS_META_QUERY, DNS_RR_TYPE_PTR, 1,
+														   t->rr.last + t->rr.ttl - now, 0, t->name };
+		}
+	}
+
+	if (!browse && !count) return false;
+
+	debug(handle, "refreshing %d records (browse %d, known answers %d)\n", count, browse_count, known_count);
+	if (browse) {
+		send_questions(handle, browses, browse_count, known, known_count);
+		// only the first browse of a discovery asks for unicast replies (RFC6762 5.4)
+		handle->loop.qu = false;
+	}
+	if (count) send_questions(handle, questions, count, NULL, 0);
+
+	NFREE(browses);
+	NFREE(known);
+	return true;
+}
+
+
+// deep copy, scalars come along with the struct so new fields need nothing here
+/*---------------------------------------------------------------------------*/
+static mdnssd_service_t *copy_service(mdnssd_service_t *s) {
+	mdnssd_service_t *p = malloc(sizeof(mdnssd_service_t));
+
+	*p = *s;
+	p->next = NULL;
+	p->name = strdup(s->name);
+	p->hostname = s->hostname ? strdup(s->hostname) : NULL;
+	p->addrs = NULL;
+	if (s->addr_count) {
+		p->addrs = malloc(s->addr_count * sizeof(struct in_addr));
+		memcpy(p->addrs, s->addrs, s->addr_count * sizeof(struct in_addr));
+	}
+	p->addrs6 = NULL;
+	if (s->addr6_count) {
+		p->addrs6 = malloc(s->addr6_count * sizeof(struct in6_addr));
+		memcpy(p->addrs6, s->addrs6, s->addr6_count * sizeof(struct in6_addr));
+	}
+	p->attr = NULL;
+	if (s->attr_count) {
+		p->attr = malloc(s->attr_count * sizeof(mdnssd_txt_attr_t));
+		for (int i = 0; i < s->attr_count; i++) {
+			p->attr[i].name = s->attr[i].name ? strdup(s->attr[i].name) : NULL;
+			p->attr[i].value = s->attr[i].value ? strdup(s->attr[i].value) : NULL;
+		}
+	}
+
+	return p;
+}
+
+
+// cache entry seen as a service (borrowing its buffers) then copied
+/*---------------------------------------------------------------------------*/
+static mdnssd_service_t *build_service(slist_t *s, uint32_t now, bool expired) {
+	mdnssd_service_t view = { 0 }, *p;
+
+	view.host = source_v4(&s->host);
+	view.host6 = IN6_IS_ADDR_V4MAPPED(&s->host) ? in6addr_any : s->host;
+	view.iface = s->local;
+	view.name = s->name;
+	view.hostname = s->hostname;
+	view.addrs = s->addrs;
+	view.addr_count = s->addr_count;
+	if (s->addr_count) view.addr = s->addrs[0];
+	view.addrs6 = s->addrs6;
+	view.addr6_count = s->addr6_count;
+	view.scope6 = s->scope6;
+	view.port = s->port;
+	view.priority = s->priority;
+	view.weight = s->weight;
+	// a goodbye (ttl = 0) means "just gone"
+	if (!expired || s->rr_ptr.ttl) {
+		if (s->rr_ptr.last) view.since = now - s->rr_ptr.last;
+		if (s->rr_srv.last && now - s->rr_srv.last > view.since) view.since = now - s->rr_srv.last;
+		if (s->rr_txt.last && now - s->rr_txt.last > view.since) view.since = now - s->rr_txt.last;
+	}
+	view.expired = expired;
+	view.flaps = s->flaps;
+
+	p = copy_service(&view);
+	mdns_parse_txt(s->txt, s->txt_length, p);
+
+	return p;
+}
+
+
+// only a change of the set is an update, not the order of arrival
+/*---------------------------------------------------------------------------*/
+static bool sync_addrs(slist_t *s, alist_t *a) {
+  bool changed = false;
+  int i;
+
+  for (i = 0; i < a->count && i < s->addr_count && s->addrs[i].s_addr == a->addrs[i].addr.s_addr; i++);
+  if (i != a->count || i != s->addr_count) {
+	s->addrs = realloc(s->addrs, a->count * sizeof(struct in_addr));
+	for (i = 0; i < a->count; i++) s->addrs[i] = a->addrs[i].addr;
+	s->addr_count = a->count;
+	changed = true;
+  }
+
+  for (i = 0; i < a->count6 && i < s->addr6_count && !memcmp(s->addrs6 + i, &a->addrs6[i].addr, sizeof(struct in6_addr)); i++);
+  if (i != a->count6 || i != s->addr6_count) {
+	s->addrs6 = realloc(s->addrs6, a->count6 * sizeof(struct in6_addr));
+	for (i = 0; i < a->count6; i++) s->addrs6[i] = a->addrs6[i].addr;
+	s->addr6_count = a->count6;
+	changed = true;
+  }
+
+  return changed;
+}
+
+
+// re-announced tombstone becomes current without new allocation
+/*---------------------------------------------------------------------------*/
+static bool revive_s(struct context_s *context, slist_t *s, uint32_t now) {
+  struct ttl_timing_s *rr[] = { &s->rr_ptr, &s->rr_srv, &s->rr_txt };
+  alist_t *a = s->hostname ? find_a(context, s->hostname, s->iface) : NULL;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+	if (rr[i]->last && now >= rr[i]->last + rr[i]->ttl) return false;
+  }
+  if (!a || (!a->count && !a->count6)) return false;
+  if (sync_addrs(s, a)) s->status = MDNS_UPDATED;
+  account_s(context, s);
+
+  s->tomb = 0;
+  s->flaps++;
+  context->held = true;
+  s->flapped = now;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static size_t size_s(slist_t *s) {
+  return sizeof(slist_t) + strlen(s->name) + 1 + (s->hostname ? strlen(s->hostname) + 1 : 0) +
+		 s->txt_length + s->addr_count * sizeof(struct in_addr) + s->addr6_count * sizeof(struct in6_addr);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static size_t size_a(alist_t *a) {
+  return sizeof(alist_t) + strlen(a->name) + 1 + a->count * sizeof(struct a_addr_s) +
+		 a->count6 * sizeof(struct aaaa_addr_s);
+}
+
+
+// cache totals follow entries as they are created, resized and removed
+/*---------------------------------------------------------------------------*/
+static void account_s(struct context_s *context, slist_t *s) {
+  size_t bytes = size_s(s);
+  if (!s->bytes) context->srecords++;
+  context->bytes += bytes - s->bytes;
+  s->bytes = bytes;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void account_a(struct context_s *context, alist_t *a) {
+  size_t bytes = size_a(a);
+  if (!a->bytes) context->arecords++;
+  context->bytes += bytes - a->bytes;
+  a->bytes = bytes;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void discount_s(struct context_s *context, slist_t *s) {
+  if (!s->bytes) return;
+  context->srecords--;
+  context->bytes -= s->bytes;
+  s->bytes = 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void discount_a(struct context_s *context, alist_t *a) {
+  if (!a->bytes) return;
+  context->arecords--;
+  context->bytes -= a->bytes;
+  a->bytes = 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int compare_victims(const void *a, const void *b) {
+  const victim_t *va = a, *vb = b;
+  if (va->reported != vb->reported) return va->reported ? 1 : -1;
+  return va->last < vb->last ? -1 : va->last > vb->last;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool over_limits(struct context_s *context) {
+  return (context->limits.entries && context->srecords + context->arecords > context->limits.entries) ||
+		 (context->limits.bytes && context->bytes > context->limits.bytes);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void evict_cache(struct context_s *context, uint32_t now, mdnssd_service_t **services) {
+  victim_t *victims;
+  int i, count = 0;
+
+  // totals are kept up to date as entries change, nothing to walk when within limits
+  if (!over_limits(context)) return;
+
+  victims = malloc((context->srecords + context->arecords) * sizeof(victim_t));
+  for (alist_t *a = context->alist; a; a = a->next) a->used = 0;
+
+  // what consumers have seen goes last (tombstones included)
+  for (slist_t *s = context->slist; s; s = s->next) {
+	uint32_t last = s->rr_ptr.last;
+	alist_t *a = s->hostname ? find_a(context, s->hostname, s->iface) : NULL;
+	if (a) a->used++;
+	if (s->rr_srv.last > last) last = s->rr_srv.last;
+	if (s->rr_txt.last > last) last = s->rr_txt.last;
+	victims[count++] = (victim_t) { !s->shadow, last, s, NULL };
+  }
+
+  for (alist_t *a = context->alist; a; a = a->next) {
+	uint32_t last = 0;
+	// a host still used by a service goes with the last of them
+	if (a->used) continue;
+	for (i = 0; i < a->count; i++) if (a->addrs[i].rr.last > last) last = a->addrs[i].rr.last;
+	for (i = 0; i < a->count6; i++) if (a->addrs6[i].rr.last > last) last = a->addrs6[i].rr.last;
+	victims[count++] = (victim_t) { false, last, NULL, a };
+  }
+
+  qsort(victims, count, sizeof(victim_t), compare_victims);
+
+  for (i = 0; i < count && over_limits(context); i++) {
+	alist_t *a = victims[i].a;
+
+	if (victims[i].s) {
+		slist_t *s = victims[i].s;
+		a = s->hostname ? find_a(context, s->hostname, s->iface) : NULL;
+		if (a && --a->used) a = NULL;
+		// consumers must know that a reported service is gone
+		// list is built backward, so takeover by another interface goes first
+		if (victims[i].reported) promote_s(context, s, now, services);
+		if (victims[i].reported && services) {
+			mdnssd_service_t *p = build_service(s, now, true);
+			p->evicted = true;
+			insert_item((item_t*) p, (item_t**) services);
+		}
+		discount_s(context, s);
+		unrank_s(context, s);
+		remove_item((item_t*) s, (item_t**) &context->slist);
+		forget_fp(context, s);
+		free_s(s);
+		context->evictions++;
+		if (!a || !over_limits(context)) continue;
+	}
+
+	discount_a(context, a);
+	remove_item((item_t*) a, (item_t**) &context->alist);
+	forget_fp(context, a);
+	free_a(a);
+	context->evictions++;
+  }
+
+  free(victims);
+}
+
+
+// a service already reported from another interface is kept aside
+/*---------------------------------------------------------------------------*/
+static bool is_shadow(struct context_s *context, slist_t *s) {
+  for (slist_t *p = context->slist; p; p = p->next) {
+	if (p != s && p->iface != s->iface && p->status == MDNS_CURRENT && !p->shadow && !strcmp(p->name, s->name)) return true;
+  }
+  return false;
+}
+
+
+// when a reported service goes, the same one on another interface is reported
+/*---------------------------------------------------------------------------*/
+static void promote_s(struct context_s *context, slist_t *s, uint32_t now, mdnssd_service_t **services) {
+  for (slist_t *p = context->slist; p; p = p->next) {
+	if (!p->shadow || p->direct || p->filtered || p->iface == s->iface || p->status != MDNS_CURRENT || strcmp(p->name, s->name)) continue;
+	p->shadow = false;
+	rank_s(context, p);
+	if (services) insert_item((item_t*) build_service(p, now, false), (item_t**) services);
+	return;
+  }
+}
+
+
+// TXT is matched in its wire format, keys are case-insensitive (RFC6763 6.4)
+/*---------------------------------------------------------------------------*/
+static bool match_txt(filter_t *f, slist_t *s) {
+  size_t klen = strlen(f->key), vlen = f->value ? strlen(f->value) : 0;
+  unsigned char *p = (unsigned char*) s->txt, *end = p + s->txt_length;
+
+  for (; p && p < end && p + 1 + *p <= end; p += 1 + *p) {
+	size_t i, len = *p;
+	char *entry = (char*) p + 1;
+
+	if (len < klen || (len > klen && entry[klen] != '=')) continue;
+	for (i = 0; i < klen && tolower((unsigned char) entry[i]) == tolower((unsigned char) f->key[i]); i++);
+	if (i < klen) continue;
+	// first occurrence of a key is the only one that counts (RFC6763 6.4)
+	if (!f->value) return true;
+	return len == klen + 1 + vlen && !memcmp(entry + klen + 1, f->value, vlen);
+  }
+
+  return false;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool match_filters(struct context_s *context, slist_t *s) {
+  for (filter_t *f = context->filters; f; f = f->next) {
+	int i;
+	switch (f->type) {
+	case FILTER_TXT:
+		if (!match_txt(f, s)) return false;
+		break;
+	case FILTER_PORT:
+		if (s->port < f->min || s->port > f->max) return false;
+		break;
+	case FILTER_SUBNET:
+		for (i = 0; i < s->addr_count && (s->addrs[i].s_addr & f->mask.s_addr) != f->net.s_addr; i++);
+		if (i == s->addr_count) return false;
+		break;
+	}
+  }
+  return true;
+}
+
+
+// a complete service is reported unless another interface already does, filters
+// reject it or it's only for a direct resolution, and when an update makes
+// filters reject a reported one, it's gone for consumers
+/*---------------------------------------------------------------------------*/
+static void report_s(struct context_s *context, slist_t *s, uint32_t now, mdnssd_service_t **services) {
+  bool reported = !s->shadow;
+
+  s->status = MDNS_CURRENT;
+  s->filtered = !match_filters(context, s);
+  s->shadow = s->direct || s->filtered || is_shadow(context, s);
+  rank_s(context, s);
+
+  // list is built backward, so takeover by another interface goes first
+  if (reported && s->shadow) promote_s(context, s, now, services);
+  if (!services) return;
+
+  if (!s->shadow) {
+	mdnssd_service_t *p = build_service(s, now, false);
+	p->added = !reported;
+	insert_item((item_t*) p, (item_t**) services);
+  } else if (reported) insert_item((item_t*) build_service(s, now, true), (item_t**) services);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void free_rank(rank_t *r) {
+  free(r->type);
+  NFREE(r->entries);
+  free(r);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void unrank_s(struct context_s *context, slist_t *s) {
+  for (rank_t *r = context->ranks; r; r = r->next) {
+	for (int i = 0; i < r->count; i++) {
+		if (r->entries[i] != s) continue;
+		memmove(r->entries + i, r->entries + i + 1, (r->count - i - 1) * sizeof(slist_t*));
+		r->count--;
+		return;
+	}
+  }
+}
+
+
+// (re)place a service in the order of its type when it's reported
+/*---------------------------------------------------------------------------*/
+static void rank_s(struct context_s *context, slist_t *s) {
+  const char *type;
+  rank_t *r;
+  int i;
+
+  unrank_s(context, s);
+  if (s->shadow || (type = match_type(context, s->name, false)) == NULL) return;
+
+  for (r = context->ranks; r && strcmp(r->type, type); r = r->next);
+  if (!r) {
+	r = calloc(1, sizeof(rank_t));
+	r->type = strdup(type);
+	insert_item((item_t*) r, (item_t**) &context->ranks);
+  }
+
+  if (r->count == r->size) {
+	r->size = r->size ? r->size * 2 : 8;
+	r->entries = realloc(r->entries, r->size * sizeof(slist_t*));
+  }
+
+  // after lower priorities, and within the same one zero weights go first
+  for (i = 0; i < r->count; i++) {
+	slist_t *p = r->entries[i];
+	if (p->priority > s->priority || (p->priority == s->priority && !s->weight && p->weight)) break;
+  }
+
+  memmove(r->entries + i + 1, r->entries + i, (r->count - i) * sizeof(slist_t*));
+  r->entries[i] = s;
+  r->count++;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static mdnssd_service_t *update_cache(struct context_s *context, bool build) {
+  mdnssd_service_t *services = NULL;
+  uint32_t now = gettime();
+  alist_t *a;
+  slist_t* s;
+
+  // expire addresses first, hosts left without any are removed at the end
+  for (a = context->alist; a; a = a->next) {
+	int count = 0;
+	a->bye = false;
+	for (int i = 0; i < a->count; i++) {
+		if (now < a->addrs[i].rr.last + a->addrs[i].rr.ttl) a->addrs[count++] = a->addrs[i];
+		else if (!a->addrs[i].rr.ttl) a->bye = true;
+	}
+	a->count = count;
+	count = 0;
+	for (int i = 0; i < a->count6; i++) {
+		if (now < a->addrs6[i].rr.last + a->addrs6[i].rr.ttl) a->addrs6[count++] = a->addrs6[i];
+		else if (!a->addrs6[i].rr.ttl) a->bye = true;
+	}
+	a->count6 = count;
+	account_a(context, a);
+  }
+
+  // stay within memory budget before reporting, so that nothing is reported and
+  // evicted in the same pass, and evictions come after this pass' changes
+  evict_cache(context, now, build ? &services : NULL);
+
+  // order of the slist is reverse time of arrival so the order of the services,
+  // as it uses the same queueing tool, will revert that back ... or so I think
+  for (s = context->slist; s; ) {
+	slist_t *next = s->next;
+	
+	// got an answer, search for A first
+	a = s->hostname ? find_a(context, s->hostname, s->iface) : NULL;
+	if (!s->port || !s->txt) a = NULL;
+	if (a && (a->count || a->count6) && sync_addrs(s, a)) {
+		s->status = MDNS_UPDATED;
+		account_s(context, s);
+	}
+
+	bool ptr_expired = (s->rr_ptr.last && now >= s->rr_ptr.last + s->rr_ptr.ttl);
+	bool srv_expired = (s->rr_srv.last && now >= s->rr_srv.last + s->rr_srv.ttl);
+	bool txt_expired = (s->rr_txt.last && now >= s->rr_txt.last + s->rr_txt.ttl);
+	bool a_expired = (a && !a->count && !a->count6);
+	// an announced departure is never held (damping is for silent expiry)
+	bool goodbye = (ptr_expired && !s->rr_ptr.ttl) || (srv_expired && !s->rr_srv.ttl) ||
+				   (txt_expired && !s->rr_txt.ttl) || (a_expired && a->bye);
+
+	// a tombstone either comes back or is finally reported as gone
+	if (s->tomb) {
+		if (!revive_s(context, s, now)) {
+			if (now < s->tomb && !goodbye) {
+				s = next;
+				continue;
+			}
+			s->tomb = 0;
+			s->status = MDNS_EXPIRED;
+			if (!s->shadow) promote_s(context, s, now, build ? &services : NULL);
+			if (build && !s->shadow) insert_item((item_t*) build_service(s, now, true), (item_t**) &services);
+			unrank_s(context, s);
+			discount_s(context, s);
+			remove_item((item_t*) s, (item_t**) &context->slist);
+			forget_fp(context, s);
+			free_s(s);
+		} else if (s->status == MDNS_UPDATED) {
+			// came back with something different
+			report_s(context, s, now, build ? &services : NULL);
+		}
+		s = next;
+		continue;
+	}
+
+	// departure of a reported service is held for a while (flap damping)
+	if (a && s->status == MDNS_CURRENT && context->damping.grace && !goodbye &&
+		(ptr_expired || srv_expired || txt_expired || a_expired)) {
+		uint32_t hold = context->damping.grace;
+		// forget flaps of a service that has been stable long enough
+		if (now - s->flapped > context->damping.max) s->flaps = 0;
+		for (int i = 0; i < s->flaps && hold < context->damping.max; i++) hold *= 2;
+		if (hold > context->damping.max) hold = context->damping.max;
+		s->tomb = now + hold;
+		context->held = true;
+		// a return goes through the normal path
+		s->rr_ptr.fp = s->rr_srv.fp = s->rr_txt.fp = 0;
+		s = next;
+		continue;
+	}
+	
+	// a service has expired - must be done before the below check to make sure
+	// that the expiry is after in the queue
+	if (a && (ptr_expired || srv_expired || txt_expired || a_expired)) {
+		s->status = MDNS_EXPIRED;
+		// same service seen on another interface takes over (list is built backward)
+		if (!s->shadow) promote_s(context, s, now, build ? &services : NULL);
+		if (build && !s->shadow) insert_item((item_t*) build_service(s, now, true), (item_t**) &services);
+		s->shadow = true;
+		unrank_s(context, s);
 	}
 
 	// a service has been updated, but it might have expired just after - so we
 	// will have both creation & destruction in the response with correct order
 	if (a && is_complete(s) && s->status != MDNS_CURRENT && s->status != MDNS_EXPIRED) {
-		s->status = MDNS_CURRENT;
-		if (build) {
-			mdnssd_service_t* p = calloc(1, sizeof(mdnssd_service_t));
-			p->host = s->host;
-			p->name = strdup(s->name);
-			p->hostname = strdup(s->hostname);
-			p->addr = s->addr;
-			p->port = s->port;
-			if (s->rr_ptr.last) p->since = now - s->rr_ptr.last;
-			if (s->rr_srv.last && now - s->rr_srv.last > p->since) p->since = now - s->rr_srv.last;
-			if (s->rr_txt.last && now - s->rr_txt.last > p->since) p->since = now - s->rr_txt.last;
-			p->expired = false;
-			mdns_parse_txt(s->txt, s->txt_length, p);
-			insert_item((item_t*)p, (item_t**)&services);
+		report_s(context, s, now, build ? &services : NULL);
+	}
+
+	// without PTR (direct resolution), the SRV is what makes the service
+	if (ptr_expired || (!s->rr_ptr.last && srv_expired)) {
+		// all RRs for service are expired.
+		// now we can remove the service
+		unrank_s(context, s);
+		discount_s(context, s);
+		remove_item((item_t*) s, (item_t**) &context->slist);
+		forget_fp(context, s);
+		free_s(s);
+	} else {
+		if (a_expired) {
+			NFREE(s->addrs);
+			NFREE(s->addrs6);
+			s->addrs = NULL;
+			s->addrs6 = NULL;
+			s->addr_count = s->addr6_count = 0;
+		}
+		if (srv_expired) {
+			NFREE(s->hostname);
+			s->port = 0;
+			s->hostname = NULL;
+		}
+		if (txt_expired) {
+			NFREE(s->txt);
+			s->txt_length = 0;
+			s->txt = NULL;
+		}
+		account_s(context, s);
+	}
+
+	s = next;
+  }
+
+  // service types that are gone
+  for (tlist_t *t = context->enumerate.types, *next; t; t = next) {
+	next = t->next;
+	if (now < t->rr.last + t->rr.ttl) continue;
+	remove_item((item_t*) t, (item_t**) &context->enumerate.types);
+	free_t(t);
+  }
+
+  // now cleanup the alist
+  a = context->alist;
+
+  while (a) {
+	  alist_t* next = a->next;
+	  if (!a->count && !a->count6) {
+		  discount_a(context, a);
+		  remove_item((item_t*)a, (item_t**)&context->alist);
+		  forget_fp(context, a);
+		  free_a(a);
+	  }
+	  a = next;
+  }
+
+  return services;
+}
+	
+
+/*---------------------------------------------------------------------------*/
+static int open_socket(mdnssd_handle_t *handle, struct in_addr host, bool compliant) {
+  int sock;
+  int res;
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int enable = 1;
+  char param;
+
+  debug(handle, "Opening socket\n");
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock < 0) {
+	debug(handle, "error opening socket");
+	return -1;
+  }
+
+  param = 32;
+  if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void*) &param, sizeof(param)) < 0) {
+	debug(handle, "error setting multicast TTL");
+	closesocket(sock);
+	return -1;
+  }
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*) &enable, sizeof(enable)) < 0) {
+	debug(handle, "error setting reuseaddr");
+	closesocket(sock);
+	return -1;
+  }
+
+  param = 1;
+  if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (void*) &param, sizeof(param)) < 0) {
+	debug(handle, "error seeting multicast_loop");
+	closesocket(sock);
+	return -1;
+  }
+
+#ifdef IP_MULTICAST_ALL
+  // each socket only gets what arrives on its own interface
+  param = 0;
+  if (host.s_addr != INADDR_ANY && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, (void*) &param, sizeof(param)) < 0) {
+	debug(handle, "error clearing multicast_all");
+  }
+#endif
+
+  // need destination address to tell unicast from multicast responses
+#if !defined(_WIN32) && defined(IP_PKTINFO)
+  if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, (void*) &enable, sizeof(enable)) < 0) {
+	debug(handle, "error setting pktinfo");
+  }
+#elif !defined(_WIN32) && defined(IP_RECVDSTADDR)
+  if (setsockopt(sock, IPPROTO_IP, IP_RECVDSTADDR, (void*) &enable, sizeof(enable)) < 0) {
+	debug(handle, "error setting recvdstaddr");
+  }
+#endif
+
+#ifndef _WIN32
+  if (compliant) {
+	socklen_t len = sizeof(enable);
+	if (!getsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, &len)) {
+		enable = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+			debug(handle, "error setting reuseport");
+		}
+	}
+  }	
+#endif
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  /* 
+   * Sending* from * 5353 indicates that we do compliant mDNS query. If we chose
+   * random ports, the ttl will be much shorter. Now, some systems like FreeBSD have
+   * an issue with re-using 5353 if a server has just been started on that same host
+   */
+  if (compliant) addr.sin_port = htons(MDNS_PORT);
+  // Windows must bind this socket to a specific address, other must not (it's *must*)
+#ifdef _WIN32
+  addr.sin_addr.s_addr = host.s_addr;
+#else
+  addr.sin_addr.s_addr = INADDR_ANY;
+#endif
+  addrlen = sizeof(addr);
+ 
+  res = bind(sock, (struct sockaddr *) &addr, addrlen);
+  if (res < 0) {
+	debug(handle, "error binding socket");
+	closesocket(sock);
+	return -1;
+  }
+
+  // set outgoing interface for multicast (optional)
+  if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_IF, (void*) &host.s_addr, sizeof(host.s_addr)) < 0)  {
+	debug(handle, "bound to if failed");
+	closesocket(sock);
+	return -1;
+  }
+ 
+#ifdef MANUAL_MEMBERSHIP
+  // join IGMP interest group
+  int sockm = socket(AF_INET, SOCK_RAW, IPPROTO_IGMP);
+  if (sockm < 0) {
+	  closesocket(sock);
+	  return -1;
+  }
+
+  // Set the destination address and multicast group
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
+
+  // Prepare the IGMP Join message
+  struct igmp_s {
+	  uint8_t  type;
+	  uint8_t  code;
+	  uint16_t ckecksum;
+	  struct in_addr group;
+  } igmp;
+
+  igmp.type = MDNS_IGMP_HOST_MEMBERSHIP_REPORT;
+  igmp.code = 0;
+  igmp.group.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
+  igmp.ckecksum = 0; 
+
+  // Calculate the IGMP checksum
+  igmp.ckecksum = htons(~(igmp.type + (igmp.code << 8) + ntohs(igmp.ckecksum) + igmp.group.s_addr));
+
+  // Send the IGMP Join message
+  if (sendto(sockm, (void*)&igmp, sizeof(igmp), 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+	  debug(handle, "can't add membership (manual)");
+	  closesocket(sockm);
+	  closesocket(sock);
+	  return -1;
+  }
+
+  closesocket(sockm);
+#else 
+  struct ip_mreq mreq;
+
+  // set multicast groups we are interested by
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_multiaddr.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
+  mreq.imr_interface.s_addr = host.s_addr; // optional
+
+  if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void*)&mreq, sizeof(mreq)) < 0) {
+	  debug(handle, "can't add membership");
+	  closesocket(sock);
+	  return -1;
+  }
+#endif
+
+  // socket must be non-blocking so that input can be drained from any event loop
+#ifdef _WIN32
+  u_long nonblock = 1;
+  ioctlsocket(sock, FIONBIO, &nonblock);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+
+  return sock;
+}
+
+
+// IPv6 socket joined to ff02::fb on interface index (0 is system's choice)
+/*---------------------------------------------------------------------------*/
+static int open_socket6(mdnssd_handle_t *handle, unsigned index, bool compliant) {
+  struct sockaddr_in6 addr;
+  struct ipv6_mreq mreq;
+  int enable = 1, hops = 255;
+  int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+
+  if (sock < 0) {
+	debug(handle, "error opening IPv6 socket");
+	return -1;
+  }
+
+  // IPv4 has its own socket
+  setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (void*) &enable, sizeof(enable));
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*) &enable, sizeof(enable));
+  setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (void*) &hops, sizeof(hops));
+  setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (void*) &enable, sizeof(enable));
+#if !defined(_WIN32) && defined(IPV6_RECVPKTINFO)
+  setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, (void*) &enable, sizeof(enable));
+#endif
+#ifndef _WIN32
+  if (compliant) setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*) &enable, sizeof(enable));
+#endif
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  if (compliant) addr.sin6_port = htons(MDNS_PORT);
+
+  if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+	debug(handle, "error binding IPv6 socket");
+	closesocket(sock);
+	return -1;
+  }
+
+  if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (void*) &index, sizeof(index)) < 0) {
+	debug(handle, "IPv6 bound to if failed");
+	closesocket(sock);
+	return -1;
+  }
+
+  memset(&mreq, 0, sizeof(mreq));
+  inet_pton(AF_INET6, MDNS_MULTICAST_ADDRESS6, &mreq.ipv6mr_multiaddr);
+  mreq.ipv6mr_interface = index;
+
+  if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (void*) &mreq, sizeof(mreq)) < 0) {
+	debug(handle, "can't add IPv6 membership");
+	closesocket(sock);
+	return -1;
+  }
+
+#ifdef _WIN32
+  u_long nonblock = 1;
+  ioctlsocket(sock, FIONBIO, &nonblock);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+
+  return sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_ipv6(struct mdnssd_handle_s *handle, bool enable) {
+  int count;
+
+  if (!handle || handle->state != MDNS_IDLE || handle->managed.running) return false;
+
+  // IPv6 sockets are always after IPv4 ones
+  for (count = 0; count < handle->iface_count && !handle->ifaces[count].v6; count++);
+  for (int i = count; i < handle->iface_count; i++) closesocket(handle->ifaces[i].sock);
+  handle->iface_count = count;
+  handle->ipv6 = false;
+
+  if (!enable) return true;
+
+  for (int i = 0; i < count; i++) {
+	int sock = open_socket6(handle, handle->ifaces[i].index, handle->compliant);
+	if (sock < 0) continue;
+	handle->ifaces[handle->iface_count] = handle->ifaces[i];
+	handle->ifaces[handle->iface_count].sock = sock;
+	handle->ifaces[handle->iface_count].v6 = true;
+	handle->iface_count++;
+	handle->ipv6 = true;
+  }
+
+  return handle->ipv6;
+}
+
+
+// multicast-capable interfaces with an IPv4 address
+/*---------------------------------------------------------------------------*/
+static int get_ifaces(struct in_addr *hosts, unsigned *index, int max) {
+  int count = 0;
+#ifdef _WIN32
+  // not enumerated on Windows, caller must provide interfaces
+  (void) hosts;
+  (void) index;
+  (void) max;
+#else
+  struct ifaddrs *ifaddr;
+
+  if (getifaddrs(&ifaddr) == -1) return 0;
+
+  for (struct ifaddrs *ifa = ifaddr; ifa && count < max; ifa = ifa->ifa_next) {
+	if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || !(ifa->ifa_flags & IFF_UP) ||
+		!(ifa->ifa_flags & IFF_MULTICAST) || (ifa->ifa_flags & IFF_LOOPBACK)) continue;
+	if (hosts) hosts[count] = ((struct sockaddr_in*) ifa->ifa_addr)->sin_addr;
+	index[count++] = if_nametoindex(ifa->ifa_name);
+  }
+
+  freeifaddrs(ifaddr);
+#endif
+  return count;
+}
+
+
+// subscribe to link and IPv4 address changes
+/*---------------------------------------------------------------------------*/
+static int open_netlink(mdnssd_handle_t *handle) {
+#ifdef __linux__
+  struct sockaddr_nl addr;
+  int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+  if (sock < 0) {
+	debug(handle, "can't open netlink, interface changes not followed\n");
+	return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+
+  if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+	debug(handle, "can't bind netlink, interface changes not followed\n");
+	closesocket(sock);
+	return -1;
+  }
+
+  return sock;
+#else
+  (void) handle;
+  return -1;
+#endif
+}
+
+
+// address of an interface, when our own has gone
+/*---------------------------------------------------------------------------*/
+static struct in_addr find_iface_addr(unsigned index) {
+  struct in_addr hosts[MDNS_MAX_IFACES * 4], none = { INADDR_ANY };
+  unsigned indexes[MDNS_MAX_IFACES * 4];
+  int count = get_ifaces(hosts, indexes, MDNS_MAX_IFACES * 4);
+
+  for (int i = 0; i < count; i++) if (indexes[i] == index) return hosts[i];
+  return none;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void process_netlink(mdnssd_handle_t *handle) {
+#ifdef __linux__
+  int len;
+
+  // events are rare, so the receive buffer can be borrowed
+  while ((len = recv(handle->netlink, handle->recvdata, DNS_BUFFER_SIZE, 0)) > 0) {
+	for (struct nlmsghdr *nh = (struct nlmsghdr*) handle->recvdata; NLMSG_OK(nh, (unsigned) len); nh = NLMSG_NEXT(nh, len)) {
+	  if (nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK) {
+		struct ifinfomsg *ifi = NLMSG_DATA(nh);
+		int rlen = IFLA_PAYLOAD(nh);
+		char *name = NULL;
+		bool up = nh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_RUNNING);
+		int i;
+
+		for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+		  if (rta->rta_type == IFLA_IFNAME) name = RTA_DATA(rta);
+		}
+
+		for (i = 0; i < handle->iface_count && handle->ifaces[i].index != (unsigned) ifi->ifi_index; i++);
+
+		// an interface deleted and created again has a new index
+		if (i == handle->iface_count && up && name) {
+		  for (i = 0; i < handle->iface_count; i++) {
+			struct iface_s *iface = handle->ifaces + i;
+			if (iface->down && iface->index && !strcmp(iface->name, name)) iface->index = ifi->ifi_index;
+		  }
+		}
+
+		// IPv4 and IPv6 sockets of that interface
+		for (i = 0; i < handle->iface_count; i++) {
+		  if (handle->ifaces[i].index == (unsigned) ifi->ifi_index) change_iface(handle, i, up, find_iface_addr(ifi->ifi_index));
+		}
+	  } else if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR) {
+		struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+		int rlen = IFA_PAYLOAD(nh);
+		struct in_addr local = { INADDR_ANY };
+		int i;
+
+		if (ifa->ifa_family != AF_INET) continue;
+
+		for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+		  if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && local.s_addr == INADDR_ANY)) {
+			memcpy(&local, RTA_DATA(rta), sizeof(local));
+		  }
 		}
+
+		for (i = 0; i < handle->iface_count && (handle->ifaces[i].v6 || handle->ifaces[i].index != ifa->ifa_index); i++);
+		if (i == handle->iface_count) continue;
+
+		if (nh->nlmsg_type == RTM_NEWADDR) {
+		  // our address is back, or a replacement for one that has gone
+		  if (local.s_addr == handle->ifaces[i].host.s_addr || handle->ifaces[i].down) change_iface(handle, i, true, local);
+		} else if (local.s_addr == handle->ifaces[i].host.s_addr) {
+		  // take another address of that interface if there is one
+		  struct in_addr host = find_iface_addr(ifa->ifa_index);
+		  change_iface(handle, i, host.s_addr != INADDR_ANY, host);
+		}
+	  }
+	}
+  }
+#else
+  (void) handle;
+#endif
+}
+
+
+// forget what has been seen on an interface, it's not reachable (anymore)
+/*---------------------------------------------------------------------------*/
+static void flush_iface(struct context_s *context, int iface, uint32_t now) {
+  for (slist_t *s = context->slist; s; s = s->next) {
+	if (s->iface != iface) continue;
+	s->rr_ptr.last = now;
+	s->rr_ptr.ttl = 0;
+  }
+
+  for (alist_t *a = context->alist; a; a = a->next) {
+	if (a->iface != iface) continue;
+	for (int i = 0; i < a->count; i++) a->addrs[i].rr.ttl = 0;
+	for (int i = 0; i < a->count6; i++) a->addrs6[i].rr.ttl = 0;
+  }
+
+  // report it straight away, as for goodbyes
+  context->goodbye = true;
+}
+
+
+// membership and outgoing interface are bound to the old address/index
+/*---------------------------------------------------------------------------*/
+static void rejoin_iface(mdnssd_handle_t *handle, struct iface_s *iface) {
+#ifdef __linux__
+  if (iface->v6) {
+	struct ipv6_mreq mreq;
+	memset(&mreq, 0, sizeof(mreq));
+	inet_pton(AF_INET6, MDNS_MULTICAST_ADDRESS6, &mreq.ipv6mr_multiaddr);
+	mreq.ipv6mr_interface = iface->index;
+	// might already be gone with the link
+	setsockopt(iface->sock, IPPROTO_IPV6, IPV6_LEAVE_GROUP, (void*) &mreq, sizeof(mreq));
+	if (setsockopt(iface->sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (void*) &mreq, sizeof(mreq)) < 0) {
+		debug(handle, "can't add IPv6 membership again");
+	}
+	if (setsockopt(iface->sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (void*) &iface->index, sizeof(iface->index)) < 0) {
+		debug(handle, "can't set IPv6 multicast interface again");
+	}
+  } else {
+	struct ip_mreqn mreq;
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
+	mreq.imr_address = iface->host;
+	mreq.imr_ifindex = iface->index;
+	setsockopt(iface->sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, (void*) &mreq, sizeof(mreq));
+	if (setsockopt(iface->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void*) &mreq, sizeof(mreq)) < 0) {
+		debug(handle, "can't add membership again");
+	}
+	if (setsockopt(iface->sock, IPPROTO_IP, IP_MULTICAST_IF, (void*) &mreq, sizeof(mreq)) < 0) {
+		debug(handle, "can't set multicast interface again");
+	}
+  }
+#else
+  (void) handle;
+  (void) iface;
+#endif
+}
+
+
+// link going down/up or address changing on one of our interfaces
+/*---------------------------------------------------------------------------*/
+static void change_iface(mdnssd_handle_t *handle, int i, bool up, struct in_addr host) {
+  struct iface_s *iface = handle->ifaces + i;
+  uint32_t now = gettime();
+
+  // nothing is reachable there anymore
+  if (!up) {
+	if (iface->down) return;
+	debug(handle, "interface %s (%u) is down\n", iface->name, iface->index);
+	iface->down = true;
+	flush_iface(&handle->context, i, now);
+	handle->loop.wake = now;
+	return;
+  }
+
+  // link flags and address changes are often both notified
+  if (!iface->down && host.s_addr == iface->host.s_addr) return;
+
+  // what was seen with another address is stale
+  if (!iface->down) flush_iface(&handle->context, i, now);
+  if (host.s_addr != INADDR_ANY) iface->host = host;
+  iface->down = false;
+
+  rejoin_iface(handle, iface);
+
+  debug(handle, "interface %s (%u) is up with %s\n", iface->name, iface->index, inet_ntoa(iface->host));
+  handle->counters.rejoins++;
+
+  // restart discovery as if just started: now and with a QU browse
+  handle->loop.qu = true;
+  handle->loop.wake = now;
+  handle->loop.last = 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+struct mdnssd_handle_s *mdnssd_init(int dbg, struct in_addr host, bool compliant) {
+  return mdnssd_init_ifaces(dbg, &host, 1, compliant);
+}
+
+
+/*---------------------------------------------------------------------------*/
+struct mdnssd_handle_s *mdnssd_init_ifaces(int dbg, struct in_addr *hosts, int count, bool compliant) {
+  struct in_addr all[MDNS_MAX_IFACES], local[MDNS_MAX_IFACES];
+  unsigned index[MDNS_MAX_IFACES], local_index[MDNS_MAX_IFACES];
+  int local_count;
+  mdnssd_handle_t *handle;
+
+  // handle comes first as it carries debug
+  handle = calloc(1, sizeof(mdnssd_handle_t));
+  handle->debug = dbg;
+
+  if (!hosts) {
+	count = get_ifaces(all, index, MDNS_MAX_IFACES);
+	hosts = all;
+	// nothing found (or not enumerated), let the system choose
+	if (!count) {
+	  all[0].s_addr = INADDR_ANY;
+	  index[0] = 0;
+	  count = 1;
+	}
+  } else {
+	if (count > MDNS_MAX_IFACES) count = MDNS_MAX_IFACES;
+	// interface indexes are needed to tell where unicast responses arrive
+	local_count = get_ifaces(local, local_index, MDNS_MAX_IFACES);
+	for (int i = 0; i < count; i++) {
+	  index[i] = 0;
+	  for (int j = 0; j < local_count; j++) if (local[j].s_addr == hosts[i].s_addr) index[i] = local_index[j];
+	}
+  }
+
+  for (int i = 0; i < count; i++) {
+	int sock = open_socket(handle, hosts[i], compliant);
+	if (sock < 0) {
+	  debug(handle, "can't use interface %s\n", inet_ntoa(hosts[i]));
+	  continue;
+	}
+	handle->ifaces[handle->iface_count] = (struct iface_s) { sock, hosts[i], index[i] };
+#ifndef _WIN32
+	if (index[i]) if_indextoname(index[i], handle->ifaces[handle->iface_count].name);
+#endif
+	handle->iface_count++;
+  }
+
+  if (!handle->iface_count) {
+	free(handle);
+	return NULL;
+  }
+
+  handle->netlink = open_netlink(handle);
+  handle->compliant = compliant;
+
+  handle->state = MDNS_IDLE;
+  handle->recvdata = malloc(DNS_BUFFER_SIZE);
+
+  return handle;
+}
+
+
+// read-only view of a file, mapped where possible
+/*---------------------------------------------------------------------------*/
+static char *map_file(const char *path, size_t *size) {
+#ifdef _WIN32
+  FILE *file = fopen(path, "rb");
+  char *data;
+  long length;
+
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  length = ftell(file);
+  rewind(file);
+  data = length > 0 ? malloc(length) : NULL;
+  if (data && fread(data, 1, length, file) != (size_t) length) {
+	free(data);
+	data = NULL;
+  }
+  fclose(file);
+  *size = length;
+  return data;
+#else
+  struct stat st;
+  void *data;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) || !st.st_size) {
+	close(fd);
+	return NULL;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  *size = st.st_size;
+  return data;
+#endif
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void unmap_file(char *data, size_t size) {
+#ifdef _WIN32
+  free(data);
+#else
+  munmap(data, size);
+#endif
+}
+
+
+// a string of the file, NULL if it does not end within
+/*---------------------------------------------------------------------------*/
+static const char *persist_string(char *data, size_t size, uint32_t offset) {
+  if (offset >= size || !memchr(data + offset, '\0', size - offset)) return NULL;
+  return data + offset;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int find_iface(mdnssd_handle_t *handle, uint32_t local, bool v6) {
+  for (int i = 0; i < handle->iface_count; i++) {
+	if (handle->ifaces[i].host.s_addr == local && handle->ifaces[i].v6 == v6) return i;
+  }
+  return -1;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t ttl_left(struct ttl_timing_s *t, uint32_t now) {
+  return t->last && now < t->last + t->ttl ? t->last + t->ttl - now : 0;
+}
+
+
+// entries are added as if just received with what is left of their ttl, services
+// that don't belong to browsed types or use an interface not opened are skipped
+/*---------------------------------------------------------------------------*/
+static void load_cache(mdnssd_handle_t *handle) {
+  struct context_s *context = &handle->context;
+  uint32_t now = gettime(), clock = (uint32_t) time(NULL), elapsed;
+  persist_header_t *header;
+  persist_service_t *services;
+  persist_host_t *hosts;
+  persist_addr_t *addrs;
+  persist_addr6_t *addrs6;
+  int loaded = 0;
+  size_t size;
+  char *data;
+
+  handle->persist.pending = false;
+  if ((data = map_file(handle->persist.path, &size)) == NULL) return;
+
+  header = (persist_header_t*) data;
+  if (size < sizeof(persist_header_t) || header->magic != PERSIST_MAGIC || header->version != PERSIST_VERSION ||
+	  header->size != size || header->strings > size ||
+	  sizeof(persist_header_t) + (uint64_t) header->services * sizeof(persist_service_t) +
+	  (uint64_t) header->hosts * sizeof(persist_host_t) + (uint64_t) header->addrs * sizeof(persist_addr_t) +
+	  (uint64_t) header->addrs6 * sizeof(persist_addr6_t) > header->strings) {
+	debug(handle, "invalid cache file %s\n", handle->persist.path);
+	unmap_file(data, size);
+	return;
+  }
+
+  services = (persist_service_t*) (header + 1);
+  hosts = (persist_host_t*) (services + header->services);
+  addrs = (persist_addr_t*) (hosts + header->hosts);
+  addrs6 = (persist_addr6_t*) (addrs + header->addrs);
+  elapsed = clock > header->saved ? clock - header->saved : 0;
+
+  for (uint32_t i = 0; i < header->hosts; i++) {
+	persist_host_t *p = hosts + i;
+	const char *name = persist_string(data, size, p->name);
+	int iface = find_iface(handle, p->local, p->v6);
+	alist_t *a;
+
+	if (!name || iface < 0 || find_a(context, (char*) name, iface) ||
+		(uint64_t) p->first + p->count > header->addrs || (uint64_t) p->first6 + p->count6 > header->addrs6) continue;
+
+	a = calloc(1, sizeof(alist_t));
+	a->addrs = malloc(p->count * sizeof(struct a_addr_s));
+	a->addrs6 = malloc(p->count6 * sizeof(struct aaaa_addr_s));
+	for (uint32_t j = p->first; j < p->first + p->count; j++) {
+		if (addrs[j].ttl <= elapsed) continue;
+		a->addrs[a->count].addr.s_addr = addrs[j].addr;
+		a->addrs[a->count++].rr = (struct ttl_timing_s) { now, 0, addrs[j].ttl - elapsed, 0 };
+	}
+	for (uint32_t j = p->first6; j < p->first6 + p->count6; j++) {
+		if (addrs6[j].ttl <= elapsed) continue;
+		memcpy(&a->addrs6[a->count6].addr, addrs6[j].addr, 16);
+		a->addrs6[a->count6++].rr = (struct ttl_timing_s) { now, 0, addrs6[j].ttl - elapsed, 0 };
+	}
+
+	if (!a->count && !a->count6) {
+		free_a(a);
+		continue;
+	}
+
+	a->name = strdup(name);
+	a->iface = iface;
+	insert_item((item_t*) a, (item_t**) &context->alist);
+	account_a(context, a);
+  }
+
+  for (uint32_t i = 0; i < header->services; i++) {
+	persist_service_t *p = services + i;
+	const char *name = persist_string(data, size, p->name);
+	const char *hostname = persist_string(data, size, p->hostname);
+	int iface = find_iface(handle, p->local, p->v6);
+	struct in6_addr host;
+	slist_t *s;
+
+	if (!name || !hostname || iface < 0 || (uint64_t) p->txt + p->txt_length > size ||
+		p->ptr <= elapsed || p->srv <= elapsed || p->txt_ttl <= elapsed || !match_type(context, name, false)) continue;
+
+	for (s = context->slist; s && (s->iface != iface || strcmp(s->name, name)); s = s->next);
+	if (s) continue;
+
+	handle->loop.iface = iface;
+	memcpy(&host, p->host, sizeof(host));
+	s = create_s(handle, host, (char*) name);
+	s->hostname = strdup(hostname);
+	s->port = p->port;
+	s->priority = p->priority;
+	s->weight = p->weight;
+	s->txt = malloc(p->txt_length);
+	s->txt_length = p->txt_length;
+	memcpy(s->txt, data + p->txt, p->txt_length);
+	s->rr_ptr = (struct ttl_timing_s) { now, 0, p->ptr - elapsed, 0 };
+	s->rr_srv = (struct ttl_timing_s) { now, 0, p->srv - elapsed, 0 };
+	s->rr_txt = (struct ttl_timing_s) { now, 0, p->txt_ttl - elapsed, 0 };
+	s->status = MDNS_UPDATED;
+	account_s(context, s);
+	loaded++;
+  }
+
+  debug(handle, "loaded %d services from %s (saved %us ago)\n", loaded, handle->persist.path, elapsed);
+  unmap_file(data, size);
+}
+
+
+// complete services (not leaving) and all hosts, written aside then renamed
+/*---------------------------------------------------------------------------*/
+static bool save_cache(mdnssd_handle_t *handle) {
+  struct context_s *context = &handle->context;
+  uint32_t now = gettime();
+  persist_header_t header = { PERSIST_MAGIC, PERSIST_VERSION, (uint32_t) time(NULL) };
+  persist_service_t *services;
+  persist_host_t *hosts;
+  persist_addr_t *addrs;
+  persist_addr6_t *addrs6;
+  size_t strings = 0;
+  char *data, *pool, *tmp;
+  FILE *file;
+  bool rc;
+
+  for (slist_t *s = context->slist; s; s = s->next) {
+	if (s->status != MDNS_CURRENT || s->tomb || s->direct || !is_complete(s) || !ttl_left(&s->rr_ptr, now)) continue;
+	header.services++;
+	strings += strlen(s->name) + 1 + strlen(s->hostname) + 1 + s->txt_length;
+  }
+
+  for (alist_t *a = context->alist; a; a = a->next) {
+	header.hosts++;
+	header.addrs += a->count;
+	header.addrs6 += a->count6;
+	strings += strlen(a->name) + 1;
+  }
+
+  header.strings = sizeof(persist_header_t) + header.services * sizeof(persist_service_t) + header.hosts * sizeof(persist_host_t) +
+				   header.addrs * sizeof(persist_addr_t) + header.addrs6 * sizeof(persist_addr6_t);
+  header.size = header.strings + strings;
+
+  data = calloc(1, header.size);
+  memcpy(data, &header, sizeof(persist_header_t));
+  services = (persist_service_t*) (data + sizeof(persist_header_t));
+  hosts = (persist_host_t*) (services + header.services);
+  addrs = (persist_addr_t*) (hosts + header.hosts);
+  addrs6 = (persist_addr6_t*) (addrs + header.addrs);
+  pool = data + header.strings;
+
+  for (slist_t *s = context->slist; s; s = s->next) {
+	if (s->status != MDNS_CURRENT || s->tomb || s->direct || !is_complete(s) || !ttl_left(&s->rr_ptr, now)) continue;
+	memcpy(services->host, &s->host, sizeof(services->host));
+	services->local = s->local.s_addr;
+	services->v6 = handle->ifaces[s->iface].v6;
+	services->port = s->port;
+	services->priority = s->priority;
+	services->weight = s->weight;
+	services->ptr = ttl_left(&s->rr_ptr, now);
+	services->srv = ttl_left(&s->rr_srv, now);
+	services->txt_ttl = ttl_left(&s->rr_txt, now);
+	services->name = pool - data;
+	pool += sprintf(pool, "%s", s->name) + 1;
+	services->hostname = pool - data;
+	pool += sprintf(pool, "%s", s->hostname) + 1;
+	services->txt = pool - data;
+	services->txt_length = s->txt_length;
+	memcpy(pool, s->txt, s->txt_length);
+	pool += s->txt_length;
+	services++;
+  }
+
+  header.addrs = header.addrs6 = 0;
+  for (alist_t *a = context->alist; a; a = a->next, hosts++) {
+	hosts->local = handle->ifaces[a->iface].host.s_addr;
+	hosts->v6 = handle->ifaces[a->iface].v6;
+	hosts->first = header.addrs;
+	hosts->count = a->count;
+	for (int i = 0; i < a->count; i++, header.addrs++) {
+		addrs[header.addrs] = (persist_addr_t) { a->addrs[i].addr.s_addr, ttl_left(&a->addrs[i].rr, now) };
+	}
+	hosts->first6 = header.addrs6;
+	hosts->count6 = a->count6;
+	for (int i = 0; i < a->count6; i++, header.addrs6++) {
+		memcpy(addrs6[header.addrs6].addr, &a->addrs6[i].addr, 16);
+		addrs6[header.addrs6].ttl = ttl_left(&a->addrs6[i].rr, now);
+	}
+	hosts->name = pool - data;
+	pool += sprintf(pool, "%s", a->name) + 1;
+  }
+
+  // readers never see a partial file
+  tmp = malloc(strlen(handle->persist.path) + 5);
+  sprintf(tmp, "%s.tmp", handle->persist.path);
+  file = fopen(tmp, "wb");
+  rc = file && fwrite(data, 1, header.size, file) == header.size;
+  if (file) fclose(file);
+#ifdef _WIN32
+  if (rc) remove(handle->persist.path);
+#endif
+  if (rc) rc = !rename(tmp, handle->persist.path);
+  else remove(tmp);
+
+  debug(handle, "saved %u services and %u hosts to %s (%d)\n", header.services, header.hosts, handle->persist.path, rc);
+  free(tmp);
+  free(data);
+  return rc;
+}
+
+
+// maps (and creates) a named segment, size is in/out, an existing segment is
+// never shrunk as readers might still map all of it
+/*---------------------------------------------------------------------------*/
+static char *open_shared(const char *name, size_t *size, bool create, void **map) {
+#ifdef _WIN32
+  MEMORY_BASIC_INFORMATION info;
+  bool exists = false;
+  char *data;
+
+  if (create) {
+	*map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD) *size, name);
+	exists = GetLastError() == ERROR_ALREADY_EXISTS;
+  } else *map = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+  if (!*map) return NULL;
+  data = MapViewOfFile(*map, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, create && !exists ? *size : 0);
+  if (!data) {
+	CloseHandle(*map);
+	return NULL;
+  }
+  if ((!create || exists) && VirtualQuery(data, &info, sizeof(info))) *size = info.RegionSize;
+  return data;
+#else
+  char path[256];
+  struct stat st;
+  void *data;
+  int fd;
+
+  // POSIX names start with a '/'
+  snprintf(path, sizeof(path), "%s%s", *name == '/' ? "" : "/", name);
+  fd = shm_open(path, create ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) || (create ? (size_t) st.st_size < *size && ftruncate(fd, *size) : !st.st_size)) {
+	close(fd);
+	return NULL;
+  }
+  if ((size_t) st.st_size > *size) *size = st.st_size;
+  data = mmap(NULL, *size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  *map = NULL;
+  return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+
+// owner also removes the name, mapped readers keep what was last published
+/*---------------------------------------------------------------------------*/
+static void close_shared(const char *name, char *data, size_t size, void *map, bool owner) {
+#ifdef _WIN32
+  UnmapViewOfFile(data);
+  CloseHandle(map);
+#else
+  munmap(data, size);
+  if (owner) {
+	char path[256];
+	snprintf(path, sizeof(path), "%s%s", *name == '/' ? "" : "/", name);
+	shm_unlink(path);
+  }
+#endif
+}
+
+
+// reported services are written in place, whatever does not fit is dropped
+/*---------------------------------------------------------------------------*/
+static void publish_shared(mdnssd_handle_t *handle) {
+  char *data = handle->shared.data;
+  shared_header_t *header = (shared_header_t*) data;
+  shared_service_t *services;
+  struct in_addr *addrs;
+  struct in6_addr *addrs6;
+  uint32_t now = gettime(), count = 0, addr_count = 0, addr6_count = 0, dropped = 0;
+  size_t used = sizeof(shared_header_t);
+  char *pool;
+
+  for (slist_t *s = handle->context.slist; s; s = s->next) {
+	size_t need;
+	if (s->status != MDNS_CURRENT || s->shadow || s->tomb || !is_complete(s)) continue;
+	need = sizeof(shared_service_t) + s->addr_count * sizeof(struct in_addr) + s->addr6_count * sizeof(struct in6_addr) +
+		   strlen(s->name) + 1 + strlen(s->hostname) + 1 + s->txt_length;
+	if (dropped || used + need > handle->shared.size) {
+		dropped++;
+		continue;
+	}
+	used += need;
+	count++;
+	addr_count += s->addr_count;
+	addr6_count += s->addr6_count;
+  }
+
+  services = (shared_service_t*) (header + 1);
+  addrs = (struct in_addr*) (services + count);
+  addrs6 = (struct in6_addr*) (addrs + addr_count);
+  pool = (char*) (addrs6 + addr6_count);
+
+  // readers retry until seq is even again
+  ATOMIC_INC(&header->seq);
+  ATOMIC_FENCE();
+
+  for (slist_t *s = handle->context.slist; s && services < (shared_service_t*) (header + 1) + count; s = s->next) {
+	if (s->status != MDNS_CURRENT || s->shadow || s->tomb || !is_complete(s)) continue;
+	*services = (shared_service_t) { 0 };
+	memcpy(services->host, &s->host, sizeof(services->host));
+	services->iface = s->local.s_addr;
+	services->scope6 = s->scope6;
+	services->port = s->port;
+	services->priority = s->priority;
+	services->weight = s->weight;
+	services->flaps = s->flaps;
+	if (s->rr_ptr.last) services->since = now - s->rr_ptr.last;
+	if (s->rr_srv.last && now - s->rr_srv.last > services->since) services->since = now - s->rr_srv.last;
+	if (s->rr_txt.last && now - s->rr_txt.last > services->since) services->since = now - s->rr_txt.last;
+	services->addrs = (char*) addrs - data;
+	services->addr_count = s->addr_count;
+	memcpy(addrs, s->addrs, s->addr_count * sizeof(struct in_addr));
+	addrs += s->addr_count;
+	services->addrs6 = (char*) addrs6 - data;
+	services->addr6_count = s->addr6_count;
+	memcpy(addrs6, s->addrs6, s->addr6_count * sizeof(struct in6_addr));
+	addrs6 += s->addr6_count;
+	services->name = pool - data;
+	pool += sprintf(pool, "%s", s->name) + 1;
+	services->hostname = pool - data;
+	pool += sprintf(pool, "%s", s->hostname) + 1;
+	services->txt = pool - data;
+	services->txt_length = s->txt_length;
+	memcpy(pool, s->txt, s->txt_length);
+	pool += s->txt_length;
+	services++;
+  }
+
+  header->count = count;
+  header->dropped = dropped;
+  header->used = used;
+  header->published = (uint32_t) time(NULL);
+
+  ATOMIC_FENCE();
+  ATOMIC_INC(&header->seq);
+
+  if (dropped) debug(handle, "shared table %s is full, %u services not published\n", handle->shared.name, dropped);
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_persist(struct mdnssd_handle_s *handle, const char *path, int interval) {
+  if (!can_configure(handle)) return false;
+
+  NFREE(handle->persist.path);
+  handle->persist.path = path ? strdup(path) : NULL;
+  handle->persist.interval = path && interval > 0 ? interval : 0;
+  handle->persist.pending = path != NULL;
+
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void stop_publish(mdnssd_handle_t *handle) {
+  if (!handle->shared.data) return;
+  close_shared(handle->shared.name, handle->shared.data, handle->shared.size, handle->shared.map, true);
+  handle->shared.data = NULL;
+  NFREE(handle->shared.name);
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_publish(struct mdnssd_handle_s *handle, const char *name, size_t size) {
+  shared_header_t *header;
+
+  if (!can_configure(handle)) return false;
+
+  stop_publish(handle);
+  if (!name) return true;
+
+  handle->shared.size = size > sizeof(shared_header_t) ? size : SHARED_SIZE;
+  handle->shared.data = open_shared(name, &handle->shared.size, true, &handle->shared.map);
+  if (!handle->shared.data) return false;
+
+  // segment might be left from a previous publisher, readers see it as changed
+  header = (shared_header_t*) handle->shared.data;
+  header->magic = SHARED_MAGIC;
+  header->version = SHARED_VERSION;
+  header->size = handle->shared.size;
+  if (header->seq & 1) header->seq++;
+  handle->shared.name = strdup(name);
+  publish_shared(handle);
+
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_set_log(struct mdnssd_handle_s *handle, int dbg, mdnssd_log_t *log, void *cookie) {
+	if (!handle) return;
+	handle->debug = dbg;
+	handle->log = log;
+	handle->log_cookie = cookie;
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_control(struct mdnssd_handle_s *handle, mdnssd_control_e request) {
+	if (!handle) return;
+	// reset useless when stopped and is taken care by the query if running
+	if (handle->state == MDNS_RUNNING) handle->control = request;
+	else if (request == MDNS_RESET) clear_context(&handle->context);
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_close(struct mdnssd_handle_s *handle) {
+	if (!handle) return;
+	// managed discovery must be stopped first and then it's just like idle
+	if (handle->managed.running) mdnssd_stop(handle);
+	publish_snapshot(handle, NULL);
+	// query is not running or is stepped by caller, clear here, otherwise the query will self-clear
+	if (handle->state == MDNS_IDLE || !handle->loop.blocking) free_handle(handle);
+	else handle->state = MDNS_IDLE;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void free_handle(mdnssd_handle_t *handle) {
+	flush_coalesce(handle);
+	stop_dispatch(handle);
+	// what has not been loaded yet is not overwritten
+	if (handle->persist.path && !handle->persist.pending) save_cache(handle);
+	NFREE(handle->persist.path);
+	clear_context(&handle->context);
+	// readers still mapped see an empty table
+	if (handle->shared.data) publish_shared(handle);
+	stop_publish(handle);
+	while (handle->context.browses) {
+		browse_t *b = handle->context.browses;
+		handle->context.browses = b->next;
+		free(b->name);
+		free(b);
+	}
+	for (char **wanted = handle->context.enumerate.wanted; wanted && *wanted; wanted++) free(*wanted);
+	NFREE(handle->context.enumerate.wanted);
+	free_filters(handle);
+	while (handle->lookups) {
+		lookup_t *l = handle->lookups;
+		handle->lookups = l->next;
+		free(l->name);
+		free(l);
+	}
+	for (int i = 0; i < handle->iface_count; i++) closesocket(handle->ifaces[i].sock);
+	handle->iface_count = 0;
+	if (handle->netlink >= 0) closesocket(handle->netlink);
+	free(handle->recvdata);
+	free(handle);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void clear_context(struct context_s *context) {
+  clear_list((void*) context->alist, (void (*)(void*)) &free_a);
+  clear_list((void*) context->slist, (void (*)(void*)) &free_s);
+  clear_list((void*) context->enumerate.types, (void (*)(void*)) &free_t);
+  clear_list((void*) context->ranks, (void (*)(void*)) &free_rank);
+  context->ranks = NULL;
+  context->slist = NULL;
+  context->alist = NULL;
+  context->enumerate.types = NULL;
+  // browsed types are kept but asked again
+  for (browse_t *b = context->browses; b; b = b->next) b->asked = false;
+  memset(context->fingerprints, 0, sizeof(context->fingerprints));
+  context->srecords = context->arecords = 0;
+  context->bytes = 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void free_item_mDNS(mdnssd_service_t* slist) {
+	int i;
+
+	free(slist->name);
+	free(slist->hostname);
+	free(slist->addrs);
+	free(slist->addrs6);
+
+	for (i = 0; i < slist->attr_count; i++) {
+		if (slist->attr[i].name) free(slist->attr[i].name);
+		if (slist->attr[i].value) free(slist->attr[i].value);
 	}
 
-	if (ptr_expired) {
-		// all RRs for service are expired.
-		// now we can remove the service
-		remove_item((item_t*) s, (item_t**) &context->slist);
-		NFREE(s);
-	} else {
-		if (a && now >= a->rr.last + a->rr.ttl) {
-			s->addr.s_addr = 0;
-			s->status = MDNS_EXPIRED;
-		}
-		if (srv_expired) {
-			NFREE(s->hostname);
-			s->port = 0;
-			s->hostname = NULL;
-		}
-		if (txt_expired) {
-			NFREE(s->txt);
-			s->txt_length = 0;
-			s->txt = NULL;
-		}
+	free(slist->attr);
+
+	free(slist);
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_free_list(mdnssd_service_t* slist) {
+  clear_list((void*) slist, (void(*)(void*)) &free_item_mDNS);
+}
+
+
+/*---------------------------------------------------------------------------*/
+mdnssd_service_t* mdnssd_get_list(struct mdnssd_handle_s *handle) {
+  mdnssd_service_t *services = NULL;
+  uint32_t now = gettime();
+
+  // when discovery is managed, the cache belongs to the thread so use a snapshot
+  if (handle->managed.running) {
+	mdnssd_snapshot_t *snapshot = mdnssd_snapshot_get(handle);
+	if (!snapshot) return NULL;
+	for (mdnssd_service_t *s = snapshot->services; s; s = s->next) {
+		insert_item((item_t*) copy_service(s), (item_t**) &services);
 	}
+	mdnssd_snapshot_put(snapshot);
+	return services;
+  }
 
-	s = next;
+  for (slist_t *s = handle->context.slist; s; s = s->next) {
+	if (is_complete(s) && !s->shadow && !s->tomb) insert_item((item_t*) build_service(s, now, false), (item_t**) &services);
   }
 
-  // now cleanup the alist
-  a = context->alist;
-  context->arecords = 0;
+  return services;
+}
 
-  while (a) {
-	  alist_t* next = a->next;
-	  context->arecords++;
-	  if (now >= a->rr.last + a->rr.ttl) {
-		  remove_item((item_t*)a, (item_t**)&context->alist);
-		  free_a(a);
-	  }
-	  a = next;
+
+/*---------------------------------------------------------------------------*/
+mdnssd_snapshot_t* mdnssd_snapshot_get(struct mdnssd_handle_s *handle) {
+  snapshot_t *snapshot;
+  long epoch;
+
+  if (!handle) return NULL;
+
+  // register as a reader of current epoch so that a concurrent publisher waits
+  // for us before dropping its reference to the snapshot we are about to take.
+  // If epoch has moved meanwhile, the publisher that flipped it might not have
+  // seen us, so register again on the new one
+  for (epoch = ATOMIC_LOAD(&handle->managed.epoch); ; ) {
+	long current;
+	ATOMIC_INC(&handle->managed.readers[epoch & 1]);
+	current = ATOMIC_LOAD(&handle->managed.epoch);
+	if (current == epoch) break;
+	ATOMIC_DEC(&handle->managed.readers[epoch & 1]);
+	epoch = current;
   }
-  
-  return services;
+  snapshot = ATOMIC_LOAD_PTR(&handle->managed.snapshot);
+  if (snapshot) ATOMIC_INC(&snapshot->refs);
+  ATOMIC_DEC(&handle->managed.readers[epoch & 1]);
+
+  return snapshot ? &snapshot->table : NULL;
 }
-	
+
 
 /*---------------------------------------------------------------------------*/
-struct mdnssd_handle_s *mdnssd_init(int dbg, struct in_addr host, bool compliant) {
-  int sock;
-  int res;
-  struct sockaddr_in addr;
-  socklen_t addrlen;
-  int enable = 1;
-  char param;
-  mdnssd_handle_t *handle;
+void mdnssd_snapshot_put(mdnssd_snapshot_t *table) {
+  snapshot_t *snapshot = (snapshot_t*) table;
 
-  debug_mode = dbg;
-  debug("Opening socket\n");
-  sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if(sock < 0) {
-	debug("error opening socket");
+  if (!snapshot || ATOMIC_DEC(&snapshot->refs)) return;
+  mdnssd_free_list(snapshot->table.services);
+  free(snapshot);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void publish_snapshot(mdnssd_handle_t *handle, snapshot_t *snapshot) {
+  snapshot_t *old;
+  long epoch;
+
+  old = ATOMIC_XCHG_PTR(&handle->managed.snapshot, snapshot);
+
+  // flip epoch and wait for readers who might have seen the previous pointer
+  // (grace period), new readers can only see the new one. Only one publisher
+  epoch = ATOMIC_INC(&handle->managed.epoch) - 1;
+  while (ATOMIC_LOAD(&handle->managed.readers[epoch & 1])) yield();
+
+  if (old) mdnssd_snapshot_put(&old->table);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void update_snapshot(mdnssd_handle_t *handle) {
+  snapshot_t *snapshot = calloc(1, sizeof(snapshot_t));
+  uint32_t now = gettime();
+
+  snapshot->refs = 1;
+  snapshot->table.version = ++handle->managed.version;
+
+  for (slist_t *s = handle->context.slist; s; s = s->next) {
+	if (s->status != MDNS_CURRENT || s->shadow || s->tomb || !is_complete(s)) continue;
+	insert_item((item_t*) build_service(s, now, false), (item_t**) &snapshot->table.services);
+	snapshot->table.count++;
+  }
+
+  publish_snapshot(handle, snapshot);
+}
+
+
+/*---------------------------------------------------------------------------*/
+mdnssd_shared_t *mdnssd_shared_open(const char *name) {
+  mdnssd_shared_t *shared;
+  shared_header_t *header;
+  void *map;
+  size_t size = 0;
+  char *data;
+
+  if (!name || (data = open_shared(name, &size, false, &map)) == NULL) return NULL;
+
+  header = (shared_header_t*) data;
+  if (size < sizeof(shared_header_t) || header->magic != SHARED_MAGIC || header->version != SHARED_VERSION) {
+	close_shared(name, data, size, map, false);
 	return NULL;
   }
 
-  param = 32;
-  if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void*) &param, sizeof(param)) < 0) {
-	printf("error setting multicast TTL");
-	closesocket(sock);
+  shared = calloc(1, sizeof(mdnssd_shared_t));
+  shared->name = strdup(name);
+  shared->data = data;
+  shared->size = size;
+  shared->map = map;
+
+  return shared;
+}
+
+
+// copy out a consistent table (no lock, writer never waits) then build from copy
+/*---------------------------------------------------------------------------*/
+mdnssd_service_t *mdnssd_shared_get(mdnssd_shared_t *shared, uint32_t *version) {
+  mdnssd_service_t *services = NULL;
+  shared_header_t *header;
+  shared_service_t *p;
+  char *data = NULL;
+  size_t used = 0;
+  uint32_t elapsed;
+  int32_t seq = 0;
+  int tries;
+
+  if (!shared) return NULL;
+
+  for (tries = 0; tries < SHARED_TRIES; tries++) {
+	header = (shared_header_t*) shared->data;
+	// a new publisher has grown the segment, our view must follow
+	if (header->size > shared->size) {
+		if (remap_shared(shared)) continue;
+		free(data);
+		return NULL;
+	}
+	seq = ATOMIC_LOAD(&header->seq);
+	if (!(seq & 1)) {
+		used = header->used;
+		if (used < sizeof(shared_header_t) || used > shared->size) used = sizeof(shared_header_t);
+		data = realloc(data, used);
+		memcpy(data, shared->data, used);
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(&header->seq) == seq) break;
+	}
+	yield();
+  }
+
+  // writer is stuck (or died) in the middle of an update
+  if (tries == SHARED_TRIES) {
+	free(data);
 	return NULL;
   }
 
-  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*) &enable, sizeof(enable)) < 0) {
-	debug("error setting reuseaddr");
-	closesocket(sock);
-	return NULL;
-  }
+  header = (shared_header_t*) data;
+  p = (shared_service_t*) (header + 1);
+  elapsed = (uint32_t) time(NULL) - header->published;
+  if (header->count > (used - sizeof(shared_header_t)) / sizeof(shared_service_t)) header->count = 0;
+
+  for (uint32_t i = 0; i < header->count; i++, p++) {
+	const char *name = persist_string(data, used, p->name), *hostname = persist_string(data, used, p->hostname);
+	struct in6_addr host;
+	mdnssd_service_t *s;
+
+	if (!name || !hostname || (uint64_t) p->txt + p->txt_length > used ||
+		(uint64_t) p->addrs + (uint64_t) p->addr_count * sizeof(struct in_addr) > used ||
+		(uint64_t) p->addrs6 + (uint64_t) p->addr6_count * sizeof(struct in6_addr) > used) continue;
+
+	s = calloc(1, sizeof(mdnssd_service_t));
+	memcpy(&host, p->host, sizeof(host));
+	s->host = source_v4(&host);
+	s->host6 = IN6_IS_ADDR_V4MAPPED(&host) ? in6addr_any : host;
+	s->iface.s_addr = p->iface;
+	s->scope6 = p->scope6;
+	s->name = strdup(name);
+	s->hostname = strdup(hostname);
+	if (p->addr_count) {
+		s->addrs = malloc(p->addr_count * sizeof(struct in_addr));
+		memcpy(s->addrs, data + p->addrs, p->addr_count * sizeof(struct in_addr));
+		s->addr_count = p->addr_count;
+		s->addr = s->addrs[0];
+	}
+	if (p->addr6_count) {
+		s->addrs6 = malloc(p->addr6_count * sizeof(struct in6_addr));
+		memcpy(s->addrs6, data + p->addrs6, p->addr6_count * sizeof(struct in6_addr));
+		s->addr6_count = p->addr6_count;
+	}
+	s->port = p->port;
+	s->priority = p->priority;
+	s->weight = p->weight;
+	s->since = p->since + elapsed;
+	s->flaps = p->flaps;
+	mdns_parse_txt(data + p->txt, p->txt_length, s);
+	insert_item((item_t*) s, (item_t**) &services);
+  }
+
+  if (version) *version = (uint32_t) seq >> 1;
+  free(data);
+  return services;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool remap_shared(mdnssd_shared_t *shared) {
+  size_t size = 0;
+  void *map;
+  char *data = open_shared(shared->name, &size, false, &map);
+
+  if (!data) return false;
+  close_shared(NULL, shared->data, shared->size, shared->map, false);
+  shared->data = data;
+  shared->size = size;
+  shared->map = map;
+
+  return size >= ((shared_header_t*) data)->size;
+}
+
+
+/*---------------------------------------------------------------------------*/
+uint32_t mdnssd_shared_version(mdnssd_shared_t *shared) {
+  if (!shared) return 0;
+  return (uint32_t) ATOMIC_LOAD(&((shared_header_t*) shared->data)->seq) >> 1;
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_shared_close(mdnssd_shared_t *shared) {
+  if (!shared) return;
+  close_shared(NULL, shared->data, shared->size, shared->map, false);
+  free(shared->name);
+  free(shared);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static THREAD_FUNC(managed_thread) {
+  mdnssd_handle_t *handle = (mdnssd_handle_t*) arg;
+
+  mdnssd_query(handle, handle->managed.query, handle->managed.unicast, 0, handle->managed.callback, handle->managed.cookie);
+
+  return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_start(struct mdnssd_handle_s *handle, const char* query, bool unicast, mdns_callback_t *callback, void *cookie) {
+  // direct resolutions are not available, so there must be a discovery
+  if (!handle || !query || !handle->iface_count || handle->state == MDNS_RUNNING || handle->managed.running) return false;
+
+  handle->managed.query = strdup(query);
+  handle->managed.unicast = unicast;
+  handle->managed.callback = callback;
+  handle->managed.cookie = cookie;
+
+  // set state now so that a control/close issued right after is not lost
+  handle->state = MDNS_RUNNING;
+  handle->managed.running = true;
+
+  if (!thread_create(&handle->managed.thread, &managed_thread, handle)) {
+	handle->managed.running = false;
+	handle->state = MDNS_IDLE;
+	NFREE(handle->managed.query);
+	handle->managed.query = NULL;
+  }
+
+  return handle->managed.running;
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_stop(struct mdnssd_handle_s *handle) {
+  if (!handle || !handle->managed.running) return;
+
+  // ask query to suspend and wait for it, last snapshot is still readable
+  handle->control = MDNS_SUSPEND;
+  thread_join(handle->managed.thread);
+
+  handle->managed.running = false;
+  free(handle->managed.query);
+  handle->managed.query = NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void cond_wait_ms(cond_t *cond, mutex_t *mutex, int ms) {
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, ms);
+#else
+  struct timespec ts;
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  ts.tv_sec = tv.tv_sec + ms / 1000;
+  ts.tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void merge_services(mdnssd_service_t **list, mdnssd_service_t *add) {
+  // only keep the latest event of a service, appended in order of arrival
+  while (add) {
+	mdnssd_service_t *next = add->next, **p = list;
+	bool unseen = false;
+	while (*p) {
+		if (!strcmp((*p)->name, add->name) && (*p)->host.s_addr == add->host.s_addr &&
+			!memcmp(&(*p)->host6, &add->host6, sizeof(add->host6))) {
+			mdnssd_service_t *old = *p;
+			// consumer has seen it before unless first report is still pending
+			if (old->expired) add->added = false;
+			else if (!add->expired) add->added = old->added;
+			else unseen = old->added;
+			*p = old->next;
+			old->next = NULL;
+			mdnssd_free_list(old);
+		} else p = &(*p)->next;
+	}
+	add->next = NULL;
+	// what came and went within the window is not reported at all
+	if (unseen) mdnssd_free_list(add);
+	else *p = add;
+	add = next;
+  }
+}
+
+
+// bounded MPMC queue (D. Vyukov), producer is the query loop but it also
+// consumes when dropping oldest, so both ends must be multi-threaded
+/*---------------------------------------------------------------------------*/
+static bool queue_push(struct dispatch_s *q, mdnssd_service_t *data, mdns_callback_t *callback, void *cookie) {
+  long pos = ATOMIC_LOAD(&q->head);
+
+  while (1) {
+	struct cell_s *cell = q->cells + (pos & q->mask);
+	long diff = ATOMIC_LOAD(&cell->seq) - pos;
+	if (!diff) {
+		if (ATOMIC_CAS(&q->head, pos, pos + 1)) {
+			cell->data = data;
+			cell->callback = callback;
+			cell->cookie = cookie;
+			ATOMIC_STORE(&cell->seq, pos + 1);
+			return true;
+		}
+	} else if (diff < 0) return false;
+	pos = ATOMIC_LOAD(&q->head);
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+static mdnssd_service_t *queue_pop(struct dispatch_s *q, mdns_callback_t **callback, void **cookie) {
+  long pos = ATOMIC_LOAD(&q->tail);
+
+  while (1) {
+	struct cell_s *cell = q->cells + (pos & q->mask);
+	long diff = ATOMIC_LOAD(&cell->seq) - (pos + 1);
+	if (!diff) {
+		if (ATOMIC_CAS(&q->tail, pos, pos + 1)) {
+			mdnssd_service_t *data = cell->data;
+			if (callback) *callback = cell->callback;
+			if (cookie) *cookie = cell->cookie;
+			ATOMIC_STORE(&cell->seq, pos + q->mask + 1);
+			return data;
+		}
+	} else if (diff < 0) return NULL;
+	pos = ATOMIC_LOAD(&q->tail);
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void queue_wake(struct dispatch_s *q) {
+  // only take the lock when someone sleeps
+  if (!ATOMIC_LOAD(&q->waiting)) return;
+  mutex_lock(&q->mutex);
+  cond_broadcast(&q->cond);
+  mutex_unlock(&q->mutex);
+}
+
+
+// producer waits a bit for the consumer to make room
+/*---------------------------------------------------------------------------*/
+static void queue_block(struct dispatch_s *q) {
+  mutex_lock(&q->mutex);
+  ATOMIC_INC(&q->waiting);
+  cond_broadcast(&q->cond);
+  cond_wait_ms(&q->cond, &q->mutex, 10);
+  ATOMIC_DEC(&q->waiting);
+  mutex_unlock(&q->mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool queue_put(struct dispatch_s *q, mdnssd_service_t *slist, mdns_callback_t *callback, void *cookie) {
+  long depth;
+
+  switch (q->policy) {
+  case MDNS_OVERFLOW_COALESCE:
+	// once something is pending, everything goes through it to keep order
+	if (slist) {
+		if (q->pending) ATOMIC_INC(&q->coalesced);
+		merge_services(&q->pending, slist);
+	}
+	if (!q->pending || !queue_push(q, q->pending, callback, cookie)) return false;
+	q->pending = NULL;
+	break;
+  case MDNS_OVERFLOW_DROP_OLDEST:
+	while (!queue_push(q, slist, callback, cookie)) {
+		mdnssd_free_list(queue_pop(q, NULL, NULL));
+		ATOMIC_INC(&q->drops);
+		ATOMIC_INC(&q->done);
+	}
+	break;
+  case MDNS_OVERFLOW_BLOCK:
+	while (!queue_push(q, slist, callback, cookie)) queue_block(q);
+	break;
+  }
+
+  depth = ATOMIC_LOAD(&q->head) - ATOMIC_LOAD(&q->tail);
+  if (depth > q->max) q->max = depth;
+
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static THREAD_FUNC(dispatch_thread) {
+  mdnssd_handle_t *handle = (mdnssd_handle_t*) arg;
+  struct dispatch_s *q = &handle->dispatch;
+
+  // drain queue even when asked to stop
+  while (1) {
+	mdns_callback_t *callback;
+	void *cookie;
+	mdnssd_service_t *slist = queue_pop(q, &callback, &cookie);
+
+	if (slist) {
+		bool stop = false;
+		// blocked producer might be waiting for room
+		queue_wake(q);
+		if (!callback || !(*callback)(slist, cookie, &stop)) mdnssd_free_list(slist);
+		if (stop) ATOMIC_STORE(&q->stop, 1);
+		// a closing query waits for its last batch to be done
+		ATOMIC_INC(&q->done);
+		queue_wake(q);
+		continue;
+	}
+
+	if (!q->running) break;
+
+	mutex_lock(&q->mutex);
+	ATOMIC_INC(&q->waiting);
+	if (ATOMIC_LOAD(&q->head) == ATOMIC_LOAD(&q->tail) && q->running) cond_wait_ms(&q->cond, &q->mutex, 100);
+	ATOMIC_DEC(&q->waiting);
+	mutex_unlock(&q->mutex);
+  }
+
+  return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void deliver(mdnssd_handle_t *handle, mdnssd_service_t *slist) {
+  // callback runs inline, even when nothing has changed
+  if (!handle->dispatch.running) {
+	if (!handle->loop.callback || !(*handle->loop.callback)(slist, handle->loop.cookie, &handle->loop.stop)) mdnssd_free_list(slist);
+	return;
+  }
+
+  // only changes are queued
+  if (!slist && !handle->dispatch.pending) return;
+  if (queue_put(&handle->dispatch, slist, handle->loop.callback, handle->loop.cookie)) queue_wake(&handle->dispatch);
+}
+
+
+// coalesced changes still waiting for room are pushed and then we wait for the
+// consumer to be done with everything, so that no callback outlives the query
+/*---------------------------------------------------------------------------*/
+static void drain_dispatch(mdnssd_handle_t *handle) {
+  struct dispatch_s *q = &handle->dispatch;
+
+  if (!q->running) return;
+  while (q->pending && !queue_push(q, q->pending, handle->loop.callback, handle->loop.cookie)) queue_block(q);
+  q->pending = NULL;
+  queue_wake(q);
+  while (ATOMIC_LOAD(&q->done) != ATOMIC_LOAD(&q->head)) queue_block(q);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void stop_dispatch(mdnssd_handle_t *handle) {
+  struct dispatch_s *q = &handle->dispatch;
+
+  if (!q->running) return;
+  drain_dispatch(handle);
+  mutex_lock(&q->mutex);
+  q->running = false;
+  cond_broadcast(&q->cond);
+  mutex_unlock(&q->mutex);
+  thread_join(q->thread);
+  mutex_destroy(&q->mutex);
+  cond_destroy(&q->cond);
+  free(q->cells);
+  q->cells = NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void flush_coalesce(mdnssd_handle_t *handle) {
+  mdnssd_service_t *slist = handle->coalesce.list;
+
+  if (!slist) return;
+  handle->coalesce.list = NULL;
+  handle->coalesce.events = 0;
+  deliver(handle, slist);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void dispatch(mdnssd_handle_t *handle, mdnssd_service_t *slist) {
+  struct coalesce_s *c = &handle->coalesce;
+  bool changed = slist || handle->context.held;
+
+  // managed mode publishes a new table whenever something changed (or was held)
+  handle->context.held = false;
+  if (changed && handle->managed.running) update_snapshot(handle);
+  if (changed && handle->shared.data) publish_shared(handle);
+
+  if (!c->window && !c->count) {
+	deliver(handle, slist);
+	return;
+  }
+
+  // accumulate changes during window, only the latest of each service is kept
+  if (slist) {
+	if (!c->list) c->first = gettime_ms();
+	for (mdnssd_service_t *p = slist; p; p = p->next) c->events++;
+	merge_services(&c->list, slist);
+  }
+
+  if (c->list && ((c->count && c->events >= c->count) || (c->window && gettime_ms() >= c->first + c->window))) {
+	flush_coalesce(handle);
+  }
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_rate_limit(struct mdnssd_handle_s *handle, int rate, int burst) {
+  if (!can_configure(handle)) return false;
+  memset(handle->limiter.buckets, 0, sizeof(handle->limiter.buckets));
+  memset(&handle->limiter.fresh, 0, sizeof(handle->limiter.fresh));
+  handle->limiter.rate = rate > 0 ? rate : 0;
+  handle->limiter.burst = burst > 1 ? burst : 1;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_cache_limit(struct mdnssd_handle_s *handle, int entries, size_t bytes) {
+  if (!can_configure(handle)) return false;
+  handle->context.limits.entries = entries > 0 ? entries : 0;
+  handle->context.limits.bytes = bytes;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_damping(struct mdnssd_handle_s *handle, int grace, int max) {
+  if (!can_configure(handle)) return false;
+  handle->context.damping.grace = grace > 0 ? grace : 0;
+  handle->context.damping.max = max > grace ? max : handle->context.damping.grace;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_coalesce(struct mdnssd_handle_s *handle, int window, int count) {
+  if (!can_configure(handle)) return false;
+  // changing between steps is fine but pending changes are sent first
+  flush_coalesce(handle);
+  handle->coalesce.window = window;
+  handle->coalesce.count = count;
+  return true;
+}
+
+
+// the loop reads settings unlocked, so only its own thread may change them: not
+// while managed or while a blocking query runs (stepped queries are fine)
+/*---------------------------------------------------------------------------*/
+static bool can_configure(mdnssd_handle_t *handle) {
+  if (!handle || handle->managed.running) return false;
+  return handle->state != MDNS_RUNNING || !handle->loop.blocking;
+}
+
 
-  param = 1;
-  if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (void*) &param, sizeof(param)) < 0) {
-	debug("error seeting multicast_loop");
-	closesocket(sock);
-	return NULL;
+/*---------------------------------------------------------------------------*/
+bool mdnssd_set_dispatch(struct mdnssd_handle_s *handle, int size, mdnssd_overflow_e policy) {
+  struct dispatch_s *q;
+
+  // can't change dispatch while a query is running
+  if (!can_configure(handle) || handle->state == MDNS_RUNNING) return false;
+  q = &handle->dispatch;
+
+  stop_dispatch(handle);
+  if (size <= 0) return true;
+
+  // queue must be a power of 2
+  for (q->mask = 1; q->mask < size; q->mask <<= 1);
+  q->cells = malloc(q->mask * sizeof(struct cell_s));
+  for (long i = 0; i < q->mask; i++) q->cells[i].seq = i;
+  q->mask--;
+  q->head = q->tail = q->done = 0;
+  q->policy = policy;
+  q->max = q->drops = q->coalesced = 0;
+
+  mutex_init(&q->mutex);
+  cond_init(&q->cond);
+  q->running = true;
+
+  if (!thread_create(&q->thread, &dispatch_thread, handle)) {
+	q->running = false;
+	mutex_destroy(&q->mutex);
+	cond_destroy(&q->cond);
+	free(q->cells);
+	q->cells = NULL;
   }
 
-#ifndef _WIN32
-  if (compliant) {
-	socklen_t len = sizeof(enable);
-	if (!getsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, &len)) {
-		enable = 1;
-		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
-			debug("error setting reuseport");
-		}
-	}
-  }	
-#endif
+  return q->running;
+}
 
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  /* 
-   * Sending* from * 5353 indicates that we do compliant mDNS query. If we chose
-   * random ports, the ttl will be much shorter. Now, some systems like FreeBSD have
-   * an issue with re-using 5353 if a server has just been started on that same host
-   */
-  if (compliant) addr.sin_port = htons(MDNS_PORT);
-  // Windows must bind this socket to a specific address, other must not (it's *must*)
-#ifdef _WIN32
-  addr.sin_addr.s_addr = host.s_addr;
-#else
-  addr.sin_addr.s_addr = INADDR_ANY;
-#endif
-  addrlen = sizeof(addr);
- 
-  res = bind(sock, (struct sockaddr *) &addr, addrlen);
-  if (res < 0) {
-	debug("error binding socket");
-	closesocket(sock);
-	return NULL;
+
+// services already reported or rejected go through filters again
+/*---------------------------------------------------------------------------*/
+static void refilter_cache(mdnssd_handle_t *handle) {
+  for (slist_t *s = handle->context.slist; s; s = s->next) {
+	if (s->status == MDNS_CURRENT && !s->direct) s->status = MDNS_UPDATED;
   }
+  handle->loop.wake = gettime();
+}
 
-  // set outgoing interface for multicast (optional)
-  if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_IF, (void*) &host.s_addr, sizeof(host.s_addr)) < 0)  {
-	debug("bound to if failed");
-	closesocket(sock);
+
+// within each priority, repeatedly pick among those left with a random number
+// between 0 and the sum of their weights (RFC2782)
+/*---------------------------------------------------------------------------*/
+mdnssd_service_t *mdnssd_select(struct mdnssd_handle_s *handle, const char *type, bool all) {
+  mdnssd_service_t *services = NULL;
+  uint32_t now = gettime();
+  slist_t **order;
+  rank_t *r;
+  int count, n = 0;
+
+  if (!handle || !type || handle->managed.running) return NULL;
+
+  for (r = handle->context.ranks; r && strcmp(r->type, type); r = r->next);
+  if (!r || !r->count) return NULL;
+
+  if (!handle->context.seed) handle->context.seed = (uint32_t) gettime_ms() | 1;
+
+  // held services are not offered (order is kept)
+  order = malloc(r->count * sizeof(slist_t*));
+  for (int i = 0; i < r->count; i++) if (!r->entries[i]->tomb) order[n++] = r->entries[i];
+
+  if (!n) {
+	free(order);
 	return NULL;
   }
- 
-#ifdef MANUAL_MEMBERSHIP
-  // join IGMP interest group
-  int sockm = socket(AF_INET, SOCK_RAW, IPPROTO_IGMP);
-  if (sockm < 0) {
-	  closesocket(sock);
-	  return NULL;
-  }
 
-  // Set the destination address and multicast group
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
+  for (int first = 0, last; first < n; first = last) {
+	for (last = first; last < n && order[last]->priority == order[first]->priority; last++);
 
-  // Prepare the IGMP Join message
-  struct igmp_s {
-	  uint8_t  type;
-	  uint8_t  code;
-	  uint16_t ckecksum;
-	  struct in_addr group;
-  } igmp;
+	for (int k = first; k < last; k++) {
+		uint32_t sum = 0, pick, run = 0;
+		slist_t *chosen;
+		int j;
 
-  igmp.type = MDNS_IGMP_HOST_MEMBERSHIP_REPORT;
-  igmp.code = 0;
-  igmp.group.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
-  igmp.ckecksum = 0; 
+		for (j = k; j < last; j++) sum += order[j]->weight;
 
-  // Calculate the IGMP checksum
-  igmp.ckecksum = htons(~(igmp.type + (igmp.code << 8) + ntohs(igmp.ckecksum) + igmp.group.s_addr));
+		// xorshift, good enough to spread load
+		handle->context.seed ^= handle->context.seed << 13;
+		handle->context.seed ^= handle->context.seed >> 17;
+		handle->context.seed ^= handle->context.seed << 5;
+		pick = handle->context.seed % (sum + 1);
 
-  // Send the IGMP Join message
-  if (sendto(sockm, (void*)&igmp, sizeof(igmp), 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-	  debug("can't add membership (manual)");
-	  closesocket(sockm);
-	  closesocket(sock);
-	  return NULL;
+		for (j = k; j < last - 1 && (run += order[j]->weight) < pick; j++);
+		chosen = order[j];
+		order[j] = order[k];
+		order[k] = chosen;
+
+		if (!all) break;
+	}
+
+	if (!all) break;
   }
 
-  closesocket(sockm);
-#else 
-  struct ip_mreq mreq;
+  // list is built backward
+  for (count = all ? n : 1; count--;) {
+	insert_item((item_t*) build_service(order[count], now, false), (item_t**) &services);
+  }
 
-  // set multicast groups we are interested by
-  memset(&mreq, 0, sizeof(mreq));
-  mreq.imr_multiaddr.s_addr = inet_addr(MDNS_MULTICAST_ADDRESS);
-  mreq.imr_interface.s_addr = host.s_addr; // optional
+  free(order);
+  return services;
+}
 
-  if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void*)&mreq, sizeof(mreq)) < 0) {
-	  debug("can't add membership");
-	  closesocket(sock);
-	  return NULL;
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_add_filter(struct mdnssd_handle_s *handle, const char *filter) {
+  filter_t f = { 0 }, *p;
+
+  if (!filter || !can_configure(handle)) return false;
+
+  if (!strncmp(filter, "txt:", 4) && filter[4] && filter[4] != '=') {
+	char *value;
+	f.type = FILTER_TXT;
+	f.key = strdup(filter + 4);
+	if ((value = strchr(f.key, '=')) != NULL) {
+		*value++ = '\0';
+		f.value = strdup(value);
+	}
+  } else if (!strncmp(filter, "port:", 5)) {
+	unsigned min, max;
+	int n = sscanf(filter + 5, "%u-%u", &min, &max);
+	if (n < 1 || min > 0xffff || (n == 2 && (max < min || max > 0xffff))) return false;
+	f.type = FILTER_PORT;
+	f.min = min;
+	f.max = n == 2 ? max : min;
+  } else if (!strncmp(filter, "subnet:", 7)) {
+	char net[INET_ADDRSTRLEN];
+	unsigned bits;
+	if (sscanf(filter + 7, "%15[0-9.]/%u", net, &bits) != 2 || bits > 32 || inet_pton(AF_INET, net, &f.net) != 1) return false;
+	f.type = FILTER_SUBNET;
+	f.mask.s_addr = htonl(bits ? 0xffffffffUL << (32 - bits) : 0);
+	f.net.s_addr &= f.mask.s_addr;
+  } else {
+	debug(handle, "unknown filter %s", filter);
+	return false;
   }
-#endif
 
-  handle = calloc(1, sizeof(mdnssd_handle_t));
-  handle->sock = sock;
-  handle->state = MDNS_IDLE;
+  p = malloc(sizeof(filter_t));
+  *p = f;
+  insert_item((item_t*) p, (item_t**) &handle->context.filters);
+  refilter_cache(handle);
 
-  return handle;
+  return true;
 }
 
 
 /*---------------------------------------------------------------------------*/
-void mdnssd_control(struct mdnssd_handle_s *handle, mdnssd_control_e request) {
-	if (!handle) return;
-	// reset useless when stopped and is taken care by the query if running
-	if (handle->state == MDNS_RUNNING) handle->control = request;
-	else if (request == MDNS_RESET) clear_context(&handle->context);
+bool mdnssd_clear_filters(struct mdnssd_handle_s *handle) {
+  if (!can_configure(handle)) return false;
+  free_filters(handle);
+  refilter_cache(handle);
+  return true;
 }
 
 
 /*---------------------------------------------------------------------------*/
-void mdnssd_close(struct mdnssd_handle_s *handle) {
-	if (!handle) return;
-	// query is not running, clear here, otherwise the query will self-clear
-	if (handle->state == MDNS_IDLE) {
-		clear_context(&handle->context);
-		closesocket(handle->sock);
-		handle->sock = -1;
-		free(handle);
-	} else handle->state = MDNS_IDLE;
+static void free_filters(mdnssd_handle_t *handle) {
+  while (handle->context.filters) {
+	filter_t *f = handle->context.filters;
+	handle->context.filters = f->next;
+	NFREE(f->key);
+	NFREE(f->value);
+	free(f);
+  }
 }
 
 
 /*---------------------------------------------------------------------------*/
-static void clear_context(struct context_s *context) {
-  clear_list((void*) context->alist, (void (*)(void*)) &free_a);
-  clear_list((void*) context->slist, (void (*)(void*)) &free_s);
-  context->slist = NULL;
-  context->alist = NULL;
+void mdnssd_get_stats(struct mdnssd_handle_s *handle, mdnssd_stats_t *stats) {
+  memset(stats, 0, sizeof(mdnssd_stats_t));
+  if (!handle) return;
+
+  stats->responses_unicast = handle->counters.unicast;
+  stats->responses_multicast = handle->counters.multicast;
+  stats->queries_qu = handle->counters.qu;
+  stats->queries_qm = handle->counters.qm;
+  stats->rejoins = handle->counters.rejoins;
+  stats->cache_services = handle->context.srecords;
+  stats->cache_hosts = handle->context.arecords;
+  stats->cache_bytes = handle->context.bytes;
+  stats->cache_evictions = handle->context.evictions;
+  stats->rate_drops = handle->limiter.drops;
+
+  // worst sources first
+  for (int i = 0; i < RATE_SLOTS; i++) {
+	struct bucket_s *b = handle->limiter.buckets + i;
+	int j;
+	if (!b->drops) continue;
+	for (j = MDNS_OFFENDERS; j > 0 && stats->offenders[j - 1].drops < b->drops; j--) {
+		if (j < MDNS_OFFENDERS) stats->offenders[j] = stats->offenders[j - 1];
+	}
+	if (j < MDNS_OFFENDERS) {
+		stats->offenders[j].addr = source_v4(&b->addr);
+		stats->offenders[j].addr6 = IN6_IS_ADDR_V4MAPPED(&b->addr) ? in6addr_any : b->addr;
+		stats->offenders[j].drops = b->drops;
+	}
+  }
+
+  if (handle->dispatch.running) {
+	stats->queue_depth = ATOMIC_LOAD(&handle->dispatch.head) - ATOMIC_LOAD(&handle->dispatch.tail);
+	stats->queue_max = handle->dispatch.max;
+	stats->queue_drops = ATOMIC_LOAD(&handle->dispatch.drops);
+	stats->queue_coalesced = ATOMIC_LOAD(&handle->dispatch.coalesced);
+  }
 }
 
 
 /*---------------------------------------------------------------------------*/
-static void free_item_mDNS(mdnssd_service_t* slist) {
-	int i;
+bool mdnssd_open_query(struct mdnssd_handle_s *handle, const char* query, bool unicast, mdns_callback_t *callback, void *cookie) {
+  bool enumerate;
 
-	free(slist->name);
-	free(slist->hostname);
+  if (!handle || !handle->iface_count) return false;
 
-	for (i = 0; i < slist->attr_count; i++) {
-		if (slist->attr[i].name) free(slist->attr[i].name);
-		if (slist->attr[i].value) free(slist->attr[i].value);
-	}
+  if (query && query[0] != '_') {
+	debug(handle, "only service queries currently supported");
+	return false;
+  }
 
-	free(slist->attr);
+  // service types enumeration is not a browse for services
+  enumerate = query && !strcmp(query, MDNS_META_QUERY);
+  if (enumerate) query = NULL;
 
-	free(slist);
+  // what has been ignored depends on query
+  if ((handle->context.query && (!query || strcmp(handle->context.query, query))) ||
+	  enumerate != handle->context.enumerate.on) {
+	memset(handle->context.fingerprints, 0, sizeof(handle->context.fingerprints));
+  }
+  handle->context.query = query;
+  handle->context.enumerate.on = enumerate;
+
+  // warm start once types to keep are known
+  if (handle->persist.pending) {
+	load_cache(handle);
+	handle->persist.next = gettime() + handle->persist.interval;
+  }
+  handle->loop.unicast = unicast;
+  handle->loop.qu = true;
+  handle->loop.callback = callback;
+  handle->loop.cookie = cookie;
+  handle->loop.stop = false;
+  handle->dispatch.stop = 0;
+  handle->loop.last = 0;
+  handle->loop.wake = gettime();
+  handle->state = MDNS_RUNNING;
+
+  return true;
 }
 
 
 /*---------------------------------------------------------------------------*/
-void mdnssd_free_list(mdnssd_service_t* slist) {
-  clear_list((void*) slist, (void(*)(void*)) &free_item_mDNS);
+int mdnssd_get_fd(struct mdnssd_handle_s *handle) {
+  return handle && handle->iface_count ? handle->ifaces[0].sock : -1;
 }
 
 
 /*---------------------------------------------------------------------------*/
-mdnssd_service_t* mdnssd_get_list(struct mdnssd_handle_s *handle) {
-  slist_t *s;
-  mdnssd_service_t *services = NULL, *p;
+int mdnssd_get_fds(struct mdnssd_handle_s *handle, int *fds, int max) {
+  int count;
+  if (!handle) return 0;
+  for (count = 0; count < handle->iface_count && count < max; count++) fds[count] = handle->ifaces[count].sock;
+  if (handle->netlink >= 0 && count < max) fds[count++] = handle->netlink;
+  return count;
+}
 
-  for (s = handle->context.slist; s; s = s->next) {
-	if (is_complete(s)) {
-		p = malloc(sizeof(mdnssd_service_t));
-		p->name = strdup(s->name);
-		p->hostname = strdup(s->hostname);
-		p->addr = s->addr;
-		p->port = s->port;
-		p->expired = false;
-		mdns_parse_txt(s->txt, s->txt_length, p);
-		insert_item((item_t*) s, (item_t**) &services);
-	}
+
+/*---------------------------------------------------------------------------*/
+int mdnssd_get_timeout(struct mdnssd_handle_s *handle) {
+  uint64_t now = gettime_ms(), deadline;
+
+  if (!handle || handle->state != MDNS_RUNNING) return -1;
+
+  // can't query more than once every 2 seconds
+  deadline = handle->loop.wake;
+  if (deadline < handle->loop.last + 2) deadline = handle->loop.last + 2;
+  deadline *= 1000;
+
+  // targeted resolution
+  if (handle->loop.resolve && deadline > handle->loop.resolve) deadline = handle->loop.resolve;
+
+  // periodic save of cache
+  if (handle->persist.interval && deadline > (uint64_t) handle->persist.next * 1000) deadline = (uint64_t) handle->persist.next * 1000;
+
+  // retry dispatch of coalesced callbacks soon
+  if (handle->dispatch.pending && deadline > now + 10) deadline = now + 10;
+
+  // end of coalescing window
+  if (handle->coalesce.list && handle->coalesce.window && deadline > handle->coalesce.first + handle->coalesce.window) {
+	deadline = handle->coalesce.first + handle->coalesce.window;
   }
 
-  return services;
+  return deadline > now ? deadline - now : 0;
 }
 
 
 /*---------------------------------------------------------------------------*/
-bool mdnssd_query(struct mdnssd_handle_s *handle, const char* query, bool unicast, int runtime, mdns_callback_t *callback, void *cookie) {
-  struct sockaddr_in addr;
-  socklen_t addrlen;
-  int res, parsed;
-  char* recvdata;
-  fd_set active_fd_set, read_fd_set, except_fd_set;
-  mdnssd_service_t *slist;
-  uint32_t now, last = 0;;
-  bool stop = false, rc = true;
-  
-  if (!handle || handle->sock < 0) return false;
-
-  if(query[0] != '_') {
-	debug("only service queries currently supported");
-	return false;;
-  }
+bool mdnssd_process_timers(struct mdnssd_handle_s *handle) {
+  uint32_t now = gettime();
 
-  if (runtime) runtime += gettime();
+  // finishing or suspending query
+  if (ATOMIC_LOAD(&handle->dispatch.stop)) handle->loop.stop = true;
+  if (handle->state == MDNS_IDLE || handle->control == MDNS_SUSPEND || handle->loop.stop) return false;
 
-  recvdata = malloc(DNS_BUFFER_SIZE);
-  if (!recvdata) return false;
+  // coalescing window might be over
+  if (handle->coalesce.list) dispatch(handle, NULL);
 
-  FD_ZERO(&active_fd_set);
-  FD_SET(handle->sock, &active_fd_set);
+  // coalesced callbacks are waiting for room in dispatch queue
+  if (handle->dispatch.pending) deliver(handle, NULL);
 
-  debug("Entering main loop\n");
+  // just clear list
+  if (handle->control == MDNS_RESET) {
+	clear_context(&handle->context);
+	if (handle->shared.data) publish_shared(handle);
+	handle->control = MDNS_NONE;
+	handle->loop.wake = now;
+	handle->loop.qu = true;
+  }
 
-  handle->context.query = query;
-  handle->state = MDNS_RUNNING;
-  uint32_t wake = gettime();
-  
-  while (1) {
-	struct timeval sel_time = {0, 50*1000};
+  // records might have expired (or been flushed) since last received packet
+  if (now >= handle->loop.wake) {
+	mdnssd_service_t *slist = update_cache(&handle->context, handle->loop.callback || handle->managed.running || handle->shared.data);
+	if (slist || handle->context.held) dispatch(handle, slist);
+	// interfaces that went away are reported like goodbyes
+	if (handle->context.goodbye) {
+	  handle->context.goodbye = false;
+	  if (handle->coalesce.list) flush_coalesce(handle);
+	}
+  }
 
-	now = gettime();
+  // direct resolutions might be answered or timed out
+  if (handle->lookups) check_lookups(handle);
 
-    // re-launch a search regularly
-    if (now >= wake && now - last > 1) {
-	 wake = now + TTL_MIN;
-	 update_wake(&handle->context, &wake, now);
-	 if (check_query(&handle->context, now)) {
-		 send_query(handle->sock, handle->context.query, DNS_RR_TYPE_PTR, unicast);
-		 last = now;
-	 }
-    }
+  // cache is saved regularly for a warm start
+  if (handle->persist.interval && now >= handle->persist.next) {
+	save_cache(handle);
+	handle->persist.next = now + handle->persist.interval;
+  }
 
-	read_fd_set = active_fd_set;
-	except_fd_set = active_fd_set;
+  // chase missing records of incomplete services
+  if (handle->loop.resolve && gettime_ms() >= handle->loop.resolve) resolve_incomplete(handle);
 
-	res = select(handle->sock + 1, &read_fd_set, NULL, &except_fd_set, &sel_time);
+  // re-launch a search regularly
+  if (now >= handle->loop.wake && now - handle->loop.last > 1) {
+	if (refresh_cache(handle, now)) handle->loop.last = now;
+	handle->loop.wake = now + TTL_MIN;
+	update_wake(&handle->context, &handle->loop.wake, now);
+  }
 
-	// finishing or suspending query
-	if (handle->state == MDNS_IDLE || handle->control == MDNS_SUSPEND || (runtime && now > runtime)) break;
+  return true;
+}
 
-	// just clear list
-	if (handle->control == MDNS_RESET) {
-	  clear_context(&handle->context);
-	  handle->control = MDNS_NONE;
-	  wake = now;
-	}
 
-	if (res < 0) {
-	  rc = false;
-	  debug("Select error\n");
-	  break;
-	}
+/*---------------------------------------------------------------------------*/
+bool mdnssd_process_input(struct mdnssd_handle_s *handle) {
+  struct in6_addr addr;
+  int res, parsed;
+  bool unicast;
+  mdnssd_service_t *slist;
+  uint32_t now;
 
-	if (res == 0) continue;
+  if (handle->state == MDNS_IDLE) return false;
 
-	if(FD_ISSET(handle->sock, &except_fd_set)) {
-	  rc = false;
-	  debug("exception on socket");
-	  break;
-	}
+  // interfaces might have changed, before reading from them
+  if (handle->netlink >= 0) process_netlink(handle);
 
+  // sockets are non-blocking, so drain what is pending on each but yield to
+  // timers after a while so that a storm can't starve them
+  for (int i = 0; i < handle->iface_count; i++) for (int n = 0; n < RECV_BUDGET; n++) {
 	// DNS messages should arrive as single packets
 	// so we don't need to worry about partial receives
-	debug("Receiving data\n");
-	addrlen = sizeof(addr);
-	res = recvfrom(handle->sock, recvdata, DNS_BUFFER_SIZE, 0, (struct sockaddr *) &addr, &addrlen);
+	debug(handle, "Receiving data\n");
+	res = recv_packet(handle, i, &addr, &unicast);
 
 	if (res < 0) {
-	  rc = false;
-	  debug("error receiving");
-	  break;
+	  if (would_block()) break;
+	  debug(handle, "error receiving");
+	  return false;
 	} else if (res == 0) {
-	  rc = false;
-	  debug("unknown error"); // TODO for TCP means connection closed, but for UDP?
+	  debug(handle, "unknown error"); // TODO for TCP means connection closed, but for UDP?
 	}
 
-	debug("Received %u bytes from %s\n", res, inet_ntoa(addr.sin_addr));
+	// flooding sources are dropped before any parsing
+	if (!rate_check(handle, addr, gettime_ms())) continue;
+
+	if (unicast) handle->counters.unicast++;
+	else handle->counters.multicast++;
+
+	if (handle->debug) {
+	  char buf[INET6_ADDRSTRLEN];
+	  debug(handle, "Received %u bytes (%s) from %s\n", res, unicast ? "unicast" : "multicast",
+			inet_ntop(AF_INET6, &addr, buf, sizeof(buf)));
+	}
 
 	parsed = 0;
-	debug("Attempting to parse received data\n");
+	debug(handle, "Attempting to parse received data\n");
 
 	// loop through received data
 	do {
 	  int resp;
 	  mDNSMessage msg;
 
-	  resp = mdns_parse_message_net(addr.sin_addr, &handle->context, recvdata+parsed, res, &msg);
+	  resp = mdns_parse_message_net(handle, addr, handle->recvdata+parsed, res, &msg);
 
 	  // if nothing else is parsable, stop parsing
 	  if (resp <= 0) break;
 
 	  parsed += resp;
-	  debug("--Parsed %u bytes of %u received bytes\n", parsed, res);
+	  debug(handle, "--Parsed %u bytes of %u received bytes\n", parsed, res);
 	} while(parsed < res); // while there is still something to parse
 
-	// build response list for requestor
-	slist = update_cache(&handle->context, callback != NULL);
-	
+	// build response list for requestor (managed mode and publisher need to know about changes)
+	slist = update_cache(&handle->context, handle->loop.callback || handle->managed.running || handle->shared.data);
+
 	// calculate next earliest wakeup time
-	wake = now + TTL_MIN;
-	update_wake(&handle->context, &wake, now);
+	now = gettime();
+	handle->loop.wake = now + TTL_MIN;
+	update_wake(&handle->context, &handle->loop.wake, now);
+
+	// use callback if set
+	dispatch(handle, slist);
 
-	// use callback if set 
-	if (callback && !(*callback)(slist, cookie, &stop) && slist) mdnssd_free_list(slist);
+	// direct resolutions completed by this datagram
+	if (handle->lookups) check_lookups(handle);
 
-	if (stop) break;
+	// goodbyes (ttl = 0) are not held by the coalescing window
+	if (handle->context.goodbye) {
+	  handle->context.goodbye = false;
+	  if (handle->coalesce.list) flush_coalesce(handle);
+	}
+
+	if (ATOMIC_LOAD(&handle->dispatch.stop)) handle->loop.stop = true;
+	if (handle->loop.stop) return false;
   }
 
-  free(recvdata);
+  // schedule resolution of what might be missing
+  resolve_incomplete(handle);
 
-  // this is request for stop, we have to clean by ourselves
-  if (handle->state == MDNS_IDLE) {
-	  clear_context(&handle->context);
-	  closesocket(handle->sock);
-	  handle->sock = -1;
-	  free(handle);
-  } else {
-	  handle->control = MDNS_NONE;
-	  handle->state = MDNS_IDLE;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+void mdnssd_close_query(struct mdnssd_handle_s *handle) {
+  if (!handle) return;
+  // don't hold changes past the end of the query
+  flush_coalesce(handle);
+  drain_dispatch(handle);
+  handle->control = MDNS_NONE;
+  handle->state = MDNS_IDLE;
+}
+
+
+/*---------------------------------------------------------------------------*/
+bool mdnssd_query(struct mdnssd_handle_s *handle, const char* query, bool unicast, int runtime, mdns_callback_t *callback, void *cookie) {
+  int res, maxfd = -1;
+  fd_set active_fd_set, read_fd_set, except_fd_set;
+  bool rc = true;
+
+  if (!mdnssd_open_query(handle, query, unicast, callback, cookie)) return false;
+
+  if (runtime) runtime += gettime();
+
+  FD_ZERO(&active_fd_set);
+  for (int i = 0; i < handle->iface_count; i++) {
+	FD_SET(handle->ifaces[i].sock, &active_fd_set);
+	if (handle->ifaces[i].sock > maxfd) maxfd = handle->ifaces[i].sock;
+  }
+  if (handle->netlink >= 0) {
+	FD_SET(handle->netlink, &active_fd_set);
+	if (handle->netlink > maxfd) maxfd = handle->netlink;
+  }
+
+  debug(handle, "Entering main loop\n");
+
+  // we own the loop, so close must let us clean-up
+  handle->loop.blocking = true;
+
+  while (mdnssd_process_timers(handle)) {
+	struct timeval sel_time = {0, 50*1000};
+	int timeout = mdnssd_get_timeout(handle);
+
+	// wake-up at least every 50ms to check control and state
+	if (timeout < 50) sel_time.tv_usec = timeout * 1000;
+
+	read_fd_set = active_fd_set;
+	except_fd_set = active_fd_set;
+
+	res = select(maxfd + 1, &read_fd_set, NULL, &except_fd_set, &sel_time);
+
+	// finishing query
+	if (handle->state == MDNS_IDLE || (runtime && gettime() > runtime)) break;
+
+	if (res < 0) {
+	  rc = false;
+	  debug(handle, "Select error\n");
+	  break;
+	}
+
+	if (res == 0) continue;
+
+	for (int i = 0; i < handle->iface_count; i++) {
+	  if (FD_ISSET(handle->ifaces[i].sock, &except_fd_set)) {
+		rc = false;
+		debug(handle, "exception on socket");
+	  }
+	}
+	if (!rc) break;
+
+	if (!mdnssd_process_input(handle)) {
+	  // a stop from callback (or a close) is not an error
+	  rc = handle->loop.stop || handle->state == MDNS_IDLE;
+	  break;
+	}
   }
 
+  handle->loop.blocking = false;
+
+  // this is request for stop, we have to clean by ourselves
+  if (handle->state == MDNS_IDLE) free_handle(handle);
+  else mdnssd_close_query(handle);
+
   return rc;
 }
@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 
 #if defined(_WIN32)
 #include <winsock2.h>
@@ -23,27 +24,177 @@ typedef struct mdnssd_txt_attr_s {
 
 typedef struct mdnssd_service_s {
   struct mdnssd_service_s *next;	// must be first
-  struct in_addr host;				// the host of the service
+  struct in_addr host;				// the host of the service (any when IPv6)
+  struct in6_addr host6;			// the host when IPv6 (unspecified otherwise)
+  struct in_addr iface;				// local interface it has been seen on
   char* name; 						// name from PTR
   char* hostname; 					// from SRV
-  struct in_addr addr; 				// from A
+  struct in_addr addr; 				// from A (first of addrs)
+  struct in_addr *addrs;			// all A of hostname, ascending order
+  int addr_count;
+  struct in6_addr *addrs6;			// all AAAA of hostname, ascending order
+  int addr6_count;
+  unsigned int scope6;				// interface index, the scope of link-local addrs6
   unsigned short port; 				// from SRV;
+  unsigned short priority, weight;	// from SRV (RFC2782)
   unsigned int since;				// seconds since last seen
   bool expired;
+  bool added;						// first report of this service (not an update)
+  int flaps;							// departures followed by a return (damping)
+  bool evicted;						// expired because cache was full
   mdnssd_txt_attr_t *attr;
   int attr_count;
 } mdnssd_service_t;
 
+// service type found by enumeration (DNS-SD meta-query)
+typedef struct mdnssd_type_s {
+  struct mdnssd_type_s *next;		// must be first
+  char *name;						// e.g. _http._tcp.local
+  int instances;					// distinct instances seen (when counted)
+  unsigned int since;				// seconds since last seen
+} mdnssd_type_t;
+
+// immutable table of current services published by the background discovery
+typedef struct mdnssd_snapshot_s {
+  mdnssd_service_t *services;		// read-only, owned by the snapshot
+  int count;
+  uint32_t version;					// increases with each publication
+} mdnssd_snapshot_t;
+
+// table published in shared memory by another process (opaque)
+typedef struct mdnssd_shared_s mdnssd_shared_t;
+
+// what dispatch does when consumer can't keep-up
+typedef enum { MDNS_OVERFLOW_COALESCE, MDNS_OVERFLOW_DROP_OLDEST, MDNS_OVERFLOW_BLOCK } mdnssd_overflow_e;
+
+#define MDNS_OFFENDERS	4
+#define MDNS_META_QUERY	"_services._dns-sd._udp.local"
+#define MDNS_MAX_IFACES	8
+
+typedef struct mdnssd_stats_s {
+  uint32_t queue_depth, queue_max;	// dispatch queue current and highest depth
+  uint32_t queue_drops;				// batches dropped (drop-oldest)
+  uint32_t queue_coalesced;			// batches merged into pending one (coalesce)
+  uint32_t responses_unicast;		// datagrams sent directly to us (QU or legacy)
+  uint32_t responses_multicast;		// datagrams sent to the group (or unknown)
+  uint32_t queries_qu, queries_qm;	// queries sent asking for unicast/multicast replies
+  uint32_t rejoins;					// interfaces that came back or changed address
+  uint32_t cache_services, cache_hosts;	// entries in cache
+  size_t cache_bytes;				// approximate memory used by cache
+  uint32_t cache_evictions;			// entries removed to stay within limits
+  uint32_t rate_drops;				// datagrams dropped by rate limiting
+  struct {
+	struct in_addr addr;
+	struct in6_addr addr6;			// when source is IPv6 (addr is then any)
+	uint32_t drops;
+  } offenders[MDNS_OFFENDERS];		// sources with most drops (currently tracked)
+} mdnssd_stats_t;
+
 struct mdnssd_handle_s;
 
 typedef enum { MDNS_NONE, MDNS_RESET, MDNS_SUSPEND } mdnssd_control_e;
 
 typedef bool mdns_callback_t(mdnssd_service_t *services, void *cookie, bool *stop);
+typedef void mdnssd_log_t(void *cookie, const char *format, va_list args);
+// result of a direct resolution, service is NULL on timeout, return true to keep it
+typedef bool mdnssd_resolve_cb_t(const char *name, mdnssd_service_t *service, void *cookie);
 
+// unicast forces QU on every query, otherwise only first query of a discovery is QU,
+// a NULL query does no discovery (only direct resolutions), a subtype query (e.g.
+// _printer._sub._http._tcp.local) reports the parent type's instances it has
 bool 					mdnssd_query(struct mdnssd_handle_s *handle, const char* query_arg, bool unicast,
 								   int runtime, mdns_callback_t *callback, void *cookie);
 struct mdnssd_handle_s*	mdnssd_init(int dbg, struct in_addr host, bool compliant);
+// same on several interfaces (all multicast-capable ones when hosts is NULL)
+struct mdnssd_handle_s*	mdnssd_init_ifaces(int dbg, struct in_addr *hosts, int count, bool compliant);
+// also listen and query on ff02::fb of each interface (set before query)
+bool					mdnssd_set_ipv6(struct mdnssd_handle_s *handle, bool enable);
+// settings below are made before query (or between steps of a non-blocking one),
+// they are refused in managed mode or while a blocking query runs
+// callbacks are queued to a consumer thread when size > 0 (not while a query runs)
+bool					mdnssd_set_dispatch(struct mdnssd_handle_s *handle, int size, mdnssd_overflow_e policy);
+// merge changes during window (ms) or until count events, 0 for both disables (a
+// service first reported and gone within it is not reported at all)
+bool					mdnssd_set_coalesce(struct mdnssd_handle_s *handle, int window, int count);
+// hold departed services for grace (s), doubled at each flap up to max (s), 0 disables.
+// Held ones are not reported gone yet, but are left out of lists, snapshots, the shared
+// table, select and the saved cache
+bool					mdnssd_set_damping(struct mdnssd_handle_s *handle, int grace, int max);
+// limit number of entries (services + hosts) and bytes held by the cache, 0 is no limit,
+// when full what was never reported goes first, then reported ones (as evicted)
+bool					mdnssd_set_cache_limit(struct mdnssd_handle_s *handle, int entries, size_t bytes);
+// allow rate datagrams per second from each source, up to burst, 0 disables. Only
+// 64 sources are tracked, new ones share one more such budget to get tracked. An
+// input step handles at most 64 datagrams, then timers run (a blocking query
+// selects again right away), so this bounds parsing, not reception
+bool					mdnssd_set_rate_limit(struct mdnssd_handle_s *handle, int rate, int burst);
+// services must pass all filters to be reported, filter is "txt:<key>[=<value>]",
+// "port:<min>[-<max>]" or "subnet:<ip>/<bits>" (IPv4), already reported ones are re-evaluated
+bool					mdnssd_add_filter(struct mdnssd_handle_s *handle, const char *filter);
+bool					mdnssd_clear_filters(struct mdnssd_handle_s *handle);
+void					mdnssd_get_stats(struct mdnssd_handle_s *handle, mdnssd_stats_t *stats);
+// warm start: services still within their ttl are loaded from path when next query
+// opens and reported right away, cache is saved there on close and every interval (s)
+bool					mdnssd_set_persist(struct mdnssd_handle_s *handle, const char *path, int interval);
+void					mdnssd_set_log(struct mdnssd_handle_s *handle, int dbg, mdnssd_log_t *log, void *cookie);
 void 					mdnssd_control(struct mdnssd_handle_s *handle, mdnssd_control_e request);
 void 					mdnssd_close(struct mdnssd_handle_s *handle);
 void 					mdnssd_free_list(mdnssd_service_t *slist);
 mdnssd_service_t* 		mdnssd_get_list(struct mdnssd_handle_s *handle);
+
+// non-blocking integration in an external event loop: open query then wait for
+// fd to be readable (level-triggered) or timeout (ms) to elapse, and process
+bool					mdnssd_open_query(struct mdnssd_handle_s *handle, const char* query_arg, bool unicast,
+										  mdns_callback_t *callback, void *cookie);
+int						mdnssd_get_fd(struct mdnssd_handle_s *handle);
+// all fds to poll when handle uses more than one interface or watches interface
+// changes (Linux), returns count
+int						mdnssd_get_fds(struct mdnssd_handle_s *handle, int *fds, int max);
+int						mdnssd_get_timeout(struct mdnssd_handle_s *handle);
+bool					mdnssd_process_input(struct mdnssd_handle_s *handle);
+bool					mdnssd_process_timers(struct mdnssd_handle_s *handle);
+// returns once the query's dispatched callbacks have run (not to be called from one)
+void					mdnssd_close_query(struct mdnssd_handle_s *handle);
+
+// direct resolution of an instance (SRV/TXT then A/AAAA) or of a hostname (A/AAAA),
+// answered from cache when fresh, otherwise asked while a query runs (call from
+// its thread, not in managed mode), callback is called once, timeout in ms
+bool					mdnssd_resolve_instance(struct mdnssd_handle_s *handle, const char *instance, int timeout,
+												mdnssd_resolve_cb_t *callback, void *cookie);
+bool					mdnssd_resolve_host(struct mdnssd_handle_s *handle, const char *hostname, int timeout,
+											mdnssd_resolve_cb_t *callback, void *cookie);
+
+// more types browsed by the same handle, services are reported like the query's
+// (call from its thread, not in managed mode)
+bool					mdnssd_subscribe(struct mdnssd_handle_s *handle, const char *type);
+bool					mdnssd_unsubscribe(struct mdnssd_handle_s *handle, const char *type);
+// a query of MDNS_META_QUERY enumerates service types, count asks each type found
+// for its instances (packed), subscribe (NULL-terminated) are types to browse
+// as soon as they are found, types are read from the query's thread
+bool					mdnssd_set_enumeration(struct mdnssd_handle_s *handle, bool count, const char **subscribe);
+mdnssd_type_t*			mdnssd_get_types(struct mdnssd_handle_s *handle);
+void					mdnssd_free_types(mdnssd_type_t *types);
+
+// RFC2782 selection among reported instances of a browsed type (as browsed): one
+// of the lowest priority picked by weight, or all in the order to try them when
+// all is set, must be freed with mdnssd_free_list (call from query's thread)
+mdnssd_service_t*		mdnssd_select(struct mdnssd_handle_s *handle, const char *type, bool all);
+
+// managed mode: discovery runs on its own thread, callback (optional) is called from it
+bool					mdnssd_start(struct mdnssd_handle_s *handle, const char* query_arg, bool unicast,
+									 mdns_callback_t *callback, void *cookie);
+void					mdnssd_stop(struct mdnssd_handle_s *handle);
+// lock-free access to the current table from any thread (never blocked, it only
+// retries while a publication is flipping), must be released with put
+mdnssd_snapshot_t*		mdnssd_snapshot_get(struct mdnssd_handle_s *handle);
+void					mdnssd_snapshot_put(mdnssd_snapshot_t *snapshot);
+
+// publisher: reported services are written to shared memory segment name (of size
+// bytes, 0 for default) whenever they change, NULL stops (a setting, as above)
+bool					mdnssd_set_publish(struct mdnssd_handle_s *handle, const char *name, size_t size);
+// reader of a published table, needs no handle nor socket: get copies current
+// services (free with mdnssd_free_list), version moves with each publication
+mdnssd_shared_t*		mdnssd_shared_open(const char *name);
+mdnssd_service_t*		mdnssd_shared_get(mdnssd_shared_t *shared, uint32_t *version);
+uint32_t				mdnssd_shared_version(mdnssd_shared_t *shared);
+void					mdnssd_shared_close(mdnssd_shared_t *shared);